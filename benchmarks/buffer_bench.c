@@ -0,0 +1,162 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Buffer pool microbenchmark
+ * Measures the cost of a csp_buffer_get/csp_buffer_free pair for a range of
+ * pool sizes, and the aggregate rate when several threads share one pool.
+ * The buffer system can only be initialised once per process, so every
+ * configuration is measured in a forked child.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include <csp/csp.h>
+
+#define BENCH_BUF_SIZE		512		// Element size used for all pools
+#define BENCH_BATCH			64		// Buffers held at the same time
+#define BENCH_ITERATIONS	200000	// get/free pairs per pool size
+#define BENCH_THREADS_MAX	8		// Highest thread count in contention run
+#define BENCH_THREAD_POOL	1024	// Pool size used in contention run
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_pool(unsigned int count) {
+
+	void * held[BENCH_BATCH];
+	unsigned int i, j, batch;
+
+	if (csp_buffer_init(count, BENCH_BUF_SIZE) != CSP_ERR_NONE) {
+		printf("%8u  failed to allocate pool\r\n", count);
+		return -1;
+	}
+
+	/* Hold a batch of buffers at a time, so the free list keeps rotating
+	 * through the entire pool instead of recycling a single element */
+	batch = count < BENCH_BATCH ? count : BENCH_BATCH;
+
+	double start = bench_now();
+	for (i = 0; i < BENCH_ITERATIONS; i += batch) {
+		for (j = 0; j < batch; j++)
+			held[j] = csp_buffer_get(100);
+		for (j = 0; j < batch; j++)
+			csp_buffer_free(held[j]);
+	}
+	double elapsed = bench_now() - start;
+
+	if (csp_buffer_remaining() != (int) count) {
+		printf("%8u  buffer leak detected, %d remaining\r\n", count, csp_buffer_remaining());
+		return -1;
+	}
+
+	printf("%8u  %10.1f ns/pair  %10.0f pairs/s\r\n", count,
+			elapsed * 1e9 / i, i / elapsed);
+
+	return 0;
+
+}
+
+static void * bench_thread(void * arg) {
+
+	void * held[BENCH_BATCH / 4];
+	unsigned int i, j;
+
+	for (i = 0; i < BENCH_ITERATIONS; i += BENCH_BATCH / 4) {
+		for (j = 0; j < BENCH_BATCH / 4; j++)
+			held[j] = csp_buffer_get(100);
+		for (j = 0; j < BENCH_BATCH / 4; j++)
+			if (held[j] != NULL)
+				csp_buffer_free(held[j]);
+	}
+
+	return NULL;
+
+}
+
+static int bench_threads(unsigned int threads) {
+
+	pthread_t handle[BENCH_THREADS_MAX];
+	unsigned int i;
+
+	if (csp_buffer_init(BENCH_THREAD_POOL, BENCH_BUF_SIZE) != CSP_ERR_NONE)
+		return -1;
+
+	double start = bench_now();
+	for (i = 0; i < threads; i++)
+		pthread_create(&handle[i], NULL, bench_thread, NULL);
+	for (i = 0; i < threads; i++)
+		pthread_join(handle[i], NULL);
+	double elapsed = bench_now() - start;
+
+	printf("%8u  %10.0f pairs/s total\r\n", threads,
+			(double) threads * BENCH_ITERATIONS / elapsed);
+
+	return 0;
+
+}
+
+/* Run a benchmark in a child process, so it gets a fresh buffer pool */
+static int bench_fork(int (*bench)(unsigned int), unsigned int arg) {
+
+	int status;
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0)
+		exit(bench(arg) == 0 ? 0 : 1);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+
+	return 0;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int count, threads;
+	int failed = 0;
+
+	printf("    pool     get+free\r\n");
+	for (count = 16; count <= 65536; count *= 4)
+		if (bench_fork(bench_pool, count) != 0)
+			failed = 1;
+
+	printf("\r\n threads     get+free, pool of %u\r\n", BENCH_THREAD_POOL);
+	for (threads = 1; threads <= BENCH_THREADS_MAX; threads *= 2)
+		if (bench_fork(bench_threads, threads) != 0)
+			failed = 1;
+
+	return failed;
+
+}
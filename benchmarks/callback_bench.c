@@ -0,0 +1,153 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Port callback latency benchmark
+ * Measures the round trip time of a small request to an echo server on the
+ * same node over loopback. The first server is a task that reads requests
+ * from a connection-less socket, the second a callback bound to its port with
+ * csp_bind_callback, which the router calls directly. The client side is the
+ * same in both cases, so the difference is the queue hop and task wakeup
+ * saved on the server side.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+#include <csp/arch/csp_thread.h>
+
+#define BENCH_ADDRESS		1		// Address of this node
+#define BENCH_SOCKET_PORT	10		// Port of the echo task
+#define BENCH_CALLBACK_PORT	11		// Port of the echo callback
+#define BENCH_CLIENT_PORT	12		// Port the replies are sent to
+#define BENCH_ROUND_TRIPS	10000	// Round trips per measurement
+#define BENCH_DATA_SIZE		8		// Bytes per request
+#define BENCH_TIMEOUT		1000	// Timeout for a reply in ms
+
+static csp_socket_t * bench_client;
+static double bench_rtt[BENCH_ROUND_TRIPS];
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Echo requests from a connection-less socket */
+CSP_DEFINE_TASK(bench_server) {
+
+	csp_socket_t * sock = csp_socket(CSP_SO_CONN_LESS);
+	csp_bind(sock, BENCH_SOCKET_PORT);
+
+	for (;;) {
+		csp_packet_t * packet = csp_recvfrom(sock, CSP_MAX_DELAY);
+		if (packet != NULL && csp_sendto_reply(packet, packet, CSP_O_NONE, 0) != CSP_ERR_NONE)
+			csp_buffer_free(packet);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Echo requests from the router task */
+static void bench_callback(csp_packet_t * packet, void * ctx) {
+
+	if (csp_sendto_reply(packet, packet, CSP_O_NONE, 0) != CSP_ERR_NONE)
+		csp_buffer_free(packet);
+
+}
+
+static int bench_compare(const void * a, const void * b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static int bench_echo(const char * name, uint8_t port) {
+
+	unsigned int i;
+
+	for (i = 0; i < BENCH_ROUND_TRIPS; i++) {
+		csp_packet_t * packet = csp_buffer_get(BENCH_DATA_SIZE);
+		if (packet == NULL) {
+			printf("%-10s  out of buffers\r\n", name);
+			return -1;
+		}
+		memset(packet->data, i, BENCH_DATA_SIZE);
+		packet->length = BENCH_DATA_SIZE;
+
+		double start = bench_now();
+		if (csp_sendto(CSP_PRIO_NORM, BENCH_ADDRESS, port, BENCH_CLIENT_PORT, CSP_O_NONE, packet, 0) != CSP_ERR_NONE) {
+			csp_buffer_free(packet);
+			printf("%-10s  send failed at round trip %u\r\n", name, i);
+			return -1;
+		}
+
+		packet = csp_recvfrom(bench_client, BENCH_TIMEOUT);
+		if (packet == NULL || packet->data[0] != (uint8_t) i) {
+			if (packet != NULL)
+				csp_buffer_free(packet);
+			printf("%-10s  no reply to round trip %u\r\n", name, i);
+			return -1;
+		}
+		bench_rtt[i] = bench_now() - start;
+		csp_buffer_free(packet);
+	}
+
+	double total = 0;
+	for (i = 0; i < BENCH_ROUND_TRIPS; i++)
+		total += bench_rtt[i];
+	qsort(bench_rtt, BENCH_ROUND_TRIPS, sizeof(double), bench_compare);
+
+	printf("%-10s  %8.1f  %8.1f  %8.1f\r\n", name, total / BENCH_ROUND_TRIPS * 1e6,
+			bench_rtt[BENCH_ROUND_TRIPS / 2] * 1e6, bench_rtt[BENCH_ROUND_TRIPS * 99 / 100] * 1e6);
+
+	return 0;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int failed = 0;
+	csp_thread_handle_t handle;
+
+	csp_buffer_init(20, 300);
+	csp_init(BENCH_ADDRESS);
+	csp_route_start_task(1000, 0);
+
+	bench_client = csp_socket(CSP_SO_CONN_LESS);
+	csp_bind(bench_client, BENCH_CLIENT_PORT);
+	csp_bind_callback(BENCH_CALLBACK_PORT, CSP_SO_NONE, bench_callback, NULL);
+	csp_thread_create(bench_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+	csp_sleep_ms(10);
+
+	printf("Loopback round trip in us, %u requests of %u bytes\r\n", BENCH_ROUND_TRIPS, BENCH_DATA_SIZE);
+	printf("server          mean       p50       p99\r\n");
+	if (bench_echo("socket", BENCH_SOCKET_PORT) != 0)
+		failed = 1;
+	if (bench_echo("callback", BENCH_CALLBACK_PORT) != 0)
+		failed = 1;
+
+	return failed;
+
+}
@@ -0,0 +1,182 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * RDP connection churn benchmark
+ * Runs short request/reply transactions, each on a new RDP connection, against
+ * an echo server on the same node. The node talks to itself through an
+ * interface that drops a share of the packets. A lost RST leaves the closing
+ * connection in CLOSE-WAIT for the connection timeout, so with loss the
+ * connection table fills up unless the library is configured with
+ * --with-rdp-quarantine. A measurement ends after BENCH_DURATION seconds, so
+ * the rate also counts the time spent waiting for a free connection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+#include <csp/arch/csp_thread.h>
+
+#define BENCH_ADDRESS		1		// Address of this node
+#define BENCH_PORT			10		// Port of the echo server
+#define BENCH_TRANSACTIONS	500		// Transactions per measurement
+#define BENCH_DATA_SIZE		20		// Bytes per request
+#define BENCH_TIMEOUT		1000	// Timeout for connect, send and reply in ms
+#define BENCH_DURATION		10		// Maximum duration of a measurement in s
+
+static unsigned int bench_loss;
+static unsigned int bench_seed = 1;
+static csp_iface_t bench_if;
+
+/* Drop bench_loss percent of the packets, and loop the rest back to this node */
+static int bench_tx(csp_packet_t * packet, uint32_t timeout) {
+
+	bench_seed = bench_seed * 1103515245 + 12345;
+	if ((bench_seed >> 16) % 100 < bench_loss) {
+		csp_buffer_free(packet);
+		return CSP_ERR_NONE;
+	}
+
+	csp_new_packet(packet, &bench_if, NULL);
+	return CSP_ERR_NONE;
+
+}
+
+static csp_iface_t bench_if = {
+	.name = "LOSSY",
+	.nexthop = bench_tx,
+};
+
+/* Echo one request per connection */
+CSP_DEFINE_TASK(bench_server) {
+
+	csp_socket_t * sock = csp_socket(CSP_SO_RDPREQ);
+	csp_bind(sock, BENCH_PORT);
+	csp_listen(sock, 10);
+
+	for (;;) {
+		csp_conn_t * conn = csp_accept(sock, CSP_MAX_DELAY);
+		if (conn == NULL)
+			continue;
+
+		csp_packet_t * packet = csp_read(conn, BENCH_TIMEOUT);
+		if (packet != NULL && !csp_send(conn, packet, BENCH_TIMEOUT))
+			csp_buffer_free(packet);
+
+		csp_close(conn);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_churn(unsigned int loss) {
+
+	unsigned int i, completed = 0, refused = 0, lost = 0;
+
+	bench_loss = loss;
+
+	double start = bench_now();
+	for (i = 0; i < BENCH_TRANSACTIONS && bench_now() - start < BENCH_DURATION; i++) {
+		csp_conn_t * conn = csp_connect(CSP_PRIO_NORM, BENCH_ADDRESS, BENCH_PORT, BENCH_TIMEOUT, CSP_O_RDP);
+		if (conn == NULL) {
+			/* Out of connections, give CLOSE-WAIT a chance to expire */
+			refused++;
+			csp_sleep_ms(10);
+			continue;
+		}
+
+		csp_packet_t * packet = csp_buffer_get(BENCH_DATA_SIZE);
+		if (packet == NULL) {
+			csp_close(conn);
+			lost++;
+			continue;
+		}
+		memset(packet->data, i, BENCH_DATA_SIZE);
+		packet->length = BENCH_DATA_SIZE;
+
+		if (!csp_send(conn, packet, BENCH_TIMEOUT)) {
+			csp_buffer_free(packet);
+			csp_close(conn);
+			lost++;
+			continue;
+		}
+
+		packet = csp_read(conn, BENCH_TIMEOUT);
+		if (packet != NULL && packet->length == BENCH_DATA_SIZE && packet->data[0] == (uint8_t) i)
+			completed++;
+		else
+			lost++;
+		if (packet != NULL)
+			csp_buffer_free(packet);
+
+		csp_close(conn);
+	}
+	double elapsed = bench_now() - start;
+
+	printf("%5u%%  %10.1f conn/s  %8u  %8u  %8u\r\n", loss,
+			completed / elapsed, completed, lost, refused);
+
+	/* Without loss, every transaction must complete */
+	return (loss == 0 && completed != BENCH_TRANSACTIONS) ? -1 : 0;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int loss;
+	int failed = 0;
+	csp_thread_handle_t handle;
+
+	csp_buffer_init(100, 300);
+	csp_init(BENCH_ADDRESS);
+	csp_route_set(BENCH_ADDRESS, &bench_if, CSP_NODE_MAC);
+	csp_route_start_task(1000, 0);
+
+	/* Running out of connections is expected, and not worth a log line each time */
+	csp_debug_set_level(CSP_ERROR, 0);
+	csp_debug_set_level(CSP_WARN, 0);
+
+	/* Fast retransmissions, and the default connection timeout for CLOSE-WAIT */
+	csp_rdp_set_opt(4, 10000, 100, 0, 50, 1);
+
+	csp_thread_create(bench_server, (signed char *) "SERVER", 1000, NULL, 0, &handle);
+
+	printf("RDP connection churn, %u transactions, %u connections, quarantine of %u\r\n",
+			BENCH_TRANSACTIONS, CSP_CONN_MAX, CSP_RDP_QUARANTINE);
+	printf(" loss        rate        done      lost   refused\r\n");
+	for (loss = 0; loss <= 10; loss += 5)
+		if (bench_churn(loss) != 0)
+			failed = 1;
+
+	return failed;
+
+}
@@ -0,0 +1,107 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Connection lookup benchmark
+ * Measures the cost of csp_conn_find on the full connection tuple, as done
+ * by the router for every incoming packet, while the connection table fills
+ * up. The linear scan is measured for comparison by adding the flags field
+ * to the mask, which bypasses the hash table. Below 32 connections the hash
+ * table is left out and both columns measure the linear scan, so configure
+ * with a large --with-max-connections to see the difference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <csp/csp.h>
+#include <csp/csp_conn.h>
+
+#define BENCH_ADDRESS		1		// Address of this node
+#define BENCH_ITERATIONS	200000	// Lookups per measurement
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Incoming identifier of the n'th connection, spread over nodes and ports */
+static csp_id_t bench_id(unsigned int n) {
+	csp_id_t id;
+	id.ext = 0;
+	id.pri = CSP_PRIO_NORM;
+	id.src = 2 + n % (CSP_ID_HOST_MAX - 2);
+	id.dst = BENCH_ADDRESS;
+	id.sport = 1 + n % CSP_MAX_BIND_PORT;
+	id.dport = CSP_MAX_BIND_PORT + 1 + n / CSP_ID_HOST_MAX;
+	return id;
+}
+
+static double bench_lookup(unsigned int count, uint32_t mask) {
+
+	unsigned int i, found = 0;
+
+	double start = bench_now();
+	for (i = 0; i < BENCH_ITERATIONS; i++)
+		if (csp_conn_find(bench_id(i % count).ext, mask) != NULL)
+			found++;
+	double elapsed = bench_now() - start;
+
+	if (found != BENCH_ITERATIONS)
+		printf("Only found %u of %u connections\r\n", found, BENCH_ITERATIONS);
+
+	return elapsed * 1e9 / BENCH_ITERATIONS;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int count = 0, next = 8;
+
+	csp_buffer_init(10, 300);
+	csp_init(BENCH_ADDRESS);
+
+	printf("   conns          hash        linear\r\n");
+	while (count < CSP_CONN_MAX) {
+
+		/* Fill the table up to the next measuring point */
+		for (; count < next && count < CSP_CONN_MAX; count++) {
+			csp_id_t idin = bench_id(count);
+			csp_id_t idout = idin;
+			if (csp_conn_new(idin, idout) == NULL) {
+				printf("Failed to create connection %u\r\n", count);
+				return 1;
+			}
+		}
+
+		printf("%8u  %9.1f ns  %9.1f ns\r\n", count,
+				bench_lookup(count, CSP_ID_CONN_MASK),
+				bench_lookup(count, CSP_ID_CONN_MASK | CSP_ID_FLAGS_MASK));
+
+		next *= 2;
+
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,174 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Queue throughput benchmark
+ * Compares the mutex based pthread_queue with the lock-free ring_queue on
+ * the POSIX port. Measures the uncontended cost of an enqueue/dequeue pair,
+ * and the throughput when several producers feed a single blocking consumer,
+ * which is how the router input and connection queues are used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <csp/csp.h>
+
+#include "pthread_queue.h"
+#include "ring_queue.h"
+
+#define BENCH_QUEUE_LENGTH	100		// Same as default connection queue length
+#define BENCH_ITERATIONS	1000000	// Items passed per measurement
+#define BENCH_PRODUCERS_MAX	4		// Highest producer count
+
+typedef struct {
+	const char * name;
+	void * (*create)(int length, size_t item_size);
+	void (*delete)(void * queue);
+	int (*enqueue)(void * queue, void * value, uint32_t timeout);
+	int (*dequeue)(void * queue, void * buf, uint32_t timeout);
+} bench_queue_t;
+
+static const bench_queue_t bench_queues[] = {
+	{
+		.name = "pthread",
+		.create = (void *) pthread_queue_create,
+		.delete = (void *) pthread_queue_delete,
+		.enqueue = (void *) pthread_queue_enqueue,
+		.dequeue = (void *) pthread_queue_dequeue,
+	},
+	{
+		.name = "ring",
+		.create = (void *) ring_queue_create,
+		.delete = (void *) ring_queue_delete,
+		.enqueue = (void *) ring_queue_enqueue,
+		.dequeue = (void *) ring_queue_dequeue,
+	},
+};
+
+typedef struct {
+	const bench_queue_t * impl;
+	void * queue;
+	unsigned int count;
+} bench_producer_t;
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_pair(const bench_queue_t * impl) {
+
+	unsigned int i;
+	uintptr_t in, out;
+
+	void * queue = impl->create(BENCH_QUEUE_LENGTH, sizeof(uintptr_t));
+	if (queue == NULL)
+		return -1;
+
+	double start = bench_now();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		in = i;
+		impl->enqueue(queue, &in, 0);
+		if (impl->dequeue(queue, &out, 0) != CSP_QUEUE_OK || out != in) {
+			printf("%-8s  lost item %u\r\n", impl->name, i);
+			impl->delete(queue);
+			return -1;
+		}
+	}
+	double elapsed = bench_now() - start;
+
+	printf("%-8s  %10.1f ns/pair\r\n", impl->name, elapsed * 1e9 / BENCH_ITERATIONS);
+
+	impl->delete(queue);
+	return 0;
+
+}
+
+static void * bench_producer(void * arg) {
+
+	bench_producer_t * p = arg;
+	uintptr_t i;
+
+	for (i = 0; i < p->count; i++)
+		p->impl->enqueue(p->queue, &i, CSP_MAX_DELAY);
+
+	return NULL;
+
+}
+
+static int bench_mpsc(const bench_queue_t * impl, unsigned int producers) {
+
+	pthread_t handle[BENCH_PRODUCERS_MAX];
+	bench_producer_t p;
+	unsigned int i, total;
+	uintptr_t item;
+
+	p.impl = impl;
+	p.queue = impl->create(BENCH_QUEUE_LENGTH, sizeof(uintptr_t));
+	p.count = BENCH_ITERATIONS / producers;
+	if (p.queue == NULL)
+		return -1;
+
+	total = p.count * producers;
+
+	double start = bench_now();
+	for (i = 0; i < producers; i++)
+		pthread_create(&handle[i], NULL, bench_producer, &p);
+	for (i = 0; i < total; i++) {
+		if (impl->dequeue(p.queue, &item, 1000) != CSP_QUEUE_OK) {
+			printf("%-8s  %9u  consumer timed out after %u items\r\n", impl->name, producers, i);
+			return -1;
+		}
+	}
+	for (i = 0; i < producers; i++)
+		pthread_join(handle[i], NULL);
+	double elapsed = bench_now() - start;
+
+	printf("%-8s  %9u  %12.0f items/s\r\n", impl->name, producers, total / elapsed);
+
+	impl->delete(p.queue);
+	return 0;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int i, producers;
+	int failed = 0;
+
+	printf("queue     enqueue+dequeue, uncontended\r\n");
+	for (i = 0; i < sizeof(bench_queues) / sizeof(bench_queues[0]); i++)
+		if (bench_pair(&bench_queues[i]) != 0)
+			failed = 1;
+
+	printf("\r\nqueue     producers  single consumer, queue length %u\r\n", BENCH_QUEUE_LENGTH);
+	for (producers = 1; producers <= BENCH_PRODUCERS_MAX; producers *= 2)
+		for (i = 0; i < sizeof(bench_queues) / sizeof(bench_queues[0]); i++)
+			if (bench_mpsc(&bench_queues[i], producers) != 0)
+				failed = 1;
+
+	return failed;
+
+}
@@ -0,0 +1,221 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * RDP loopback throughput benchmark
+ * Streams segments over an RDP connection to a sink on the same node, and
+ * reports the rate at which the sender gets them through. Over loopback the
+ * link is never the bottleneck, so the result shows how quickly a sender that
+ * blocks on a full window is woken when ACKs open it again. Window sizes above
+ * --with-rdp-max-window are clamped. The second run transfers a 1 MB buffer
+ * with csp_rdp_send_stream and csp_rdp_recv_stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+#include <csp/arch/csp_thread.h>
+#include <csp/arch/csp_semaphore.h>
+
+#define BENCH_ADDRESS		1		// Address of this node
+#define BENCH_PORT			10		// Port of the sink
+#define BENCH_SEGMENTS		2000	// Segments sent per measurement
+#define BENCH_DATA_SIZE		200		// Data bytes per segment
+#define BENCH_TIMEOUT		5000	// Timeout for send and receive in ms
+#define BENCH_STREAM_PORT	11		// Port of the stream sink
+#define BENCH_STREAM_SIZE	(1024 * 1024)	// Bytes per stream transfer
+
+static csp_bin_sem_handle_t bench_done;
+static unsigned int bench_received;
+static uint8_t bench_tx[BENCH_STREAM_SIZE];
+static uint8_t bench_rx[BENCH_STREAM_SIZE];
+
+/* Receive and count segments until the sender closes the connection */
+CSP_DEFINE_TASK(bench_sink) {
+
+	csp_socket_t * sock = csp_socket(CSP_SO_RDPREQ);
+	csp_bind(sock, BENCH_PORT);
+	csp_listen(sock, 5);
+
+	for (;;) {
+		csp_conn_t * conn = csp_accept(sock, CSP_MAX_DELAY);
+		if (conn == NULL)
+			continue;
+
+		csp_packet_t * packet;
+		while ((packet = csp_read(conn, BENCH_TIMEOUT)) != NULL) {
+			bench_received++;
+			csp_buffer_free(packet);
+		}
+
+		csp_close(conn);
+		csp_bin_sem_post(&bench_done);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Receive one stream per connection into bench_rx */
+CSP_DEFINE_TASK(bench_stream_sink) {
+
+	csp_socket_t * sock = csp_socket(CSP_SO_RDPREQ);
+	csp_bind(sock, BENCH_STREAM_PORT);
+	csp_listen(sock, 5);
+
+	for (;;) {
+		csp_conn_t * conn = csp_accept(sock, CSP_MAX_DELAY);
+		if (conn == NULL)
+			continue;
+
+		int received = csp_rdp_recv_stream(conn, bench_rx, BENCH_STREAM_SIZE, BENCH_TIMEOUT);
+		bench_received = received > 0 ? received : 0;
+
+		csp_close(conn);
+		csp_bin_sem_post(&bench_done);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_window(unsigned int window) {
+
+	unsigned int i;
+
+	/* Disable delayed ACKs, so the ACK timing only depends on the stack */
+	csp_rdp_set_opt(window, 10000, 1000, 0, 250, 1);
+	bench_received = 0;
+
+	csp_conn_t * conn = csp_connect(CSP_PRIO_NORM, BENCH_ADDRESS, BENCH_PORT, BENCH_TIMEOUT, CSP_O_RDP);
+	if (conn == NULL) {
+		printf("%8u  connect failed\r\n", window);
+		return -1;
+	}
+
+	double start = bench_now();
+	for (i = 0; i < BENCH_SEGMENTS; i++) {
+		csp_packet_t * packet = csp_buffer_get(BENCH_DATA_SIZE);
+		if (packet == NULL) {
+			printf("%8u  out of buffers\r\n", window);
+			break;
+		}
+		memset(packet->data, i, BENCH_DATA_SIZE);
+		packet->length = BENCH_DATA_SIZE;
+		if (!csp_send(conn, packet, BENCH_TIMEOUT)) {
+			printf("%8u  send failed at segment %u\r\n", window, i);
+			csp_buffer_free(packet);
+			break;
+		}
+	}
+
+	/* Wait for the sink to receive the last segment */
+	while (bench_received < i && bench_now() - start < BENCH_TIMEOUT / 1000.0)
+		csp_sleep_ms(1);
+	double elapsed = bench_now() - start;
+
+	csp_close(conn);
+	csp_bin_sem_wait(&bench_done, BENCH_TIMEOUT * 2);
+
+	if (bench_received != BENCH_SEGMENTS) {
+		printf("%8u  only %u of %u segments received\r\n", window, bench_received, BENCH_SEGMENTS);
+		return -1;
+	}
+
+	printf("%8u  %10.0f segments/s  %8.1f kB/s\r\n", window,
+			BENCH_SEGMENTS / elapsed, BENCH_SEGMENTS * BENCH_DATA_SIZE / elapsed / 1000);
+
+	return 0;
+
+}
+
+static int bench_stream(unsigned int window) {
+
+	unsigned int i;
+
+	csp_rdp_set_opt(window, 10000, 1000, 0, 250, 1);
+	bench_received = 0;
+	memset(bench_rx, 0, sizeof(bench_rx));
+	for (i = 0; i < BENCH_STREAM_SIZE; i++)
+		bench_tx[i] = i * 7 + window;
+
+	csp_conn_t * conn = csp_connect(CSP_PRIO_NORM, BENCH_ADDRESS, BENCH_STREAM_PORT, BENCH_TIMEOUT, CSP_O_RDP);
+	if (conn == NULL) {
+		printf("%8u  connect failed\r\n", window);
+		return -1;
+	}
+
+	double start = bench_now();
+	int sent = csp_rdp_send_stream(conn, bench_tx, BENCH_STREAM_SIZE, BENCH_TIMEOUT);
+	csp_bin_sem_wait(&bench_done, BENCH_TIMEOUT * 2);
+	double elapsed = bench_now() - start;
+
+	csp_close(conn);
+
+	if (sent != BENCH_STREAM_SIZE || bench_received != BENCH_STREAM_SIZE
+			|| memcmp(bench_tx, bench_rx, BENCH_STREAM_SIZE) != 0) {
+		printf("%8u  stream failed, %d bytes sent, %u received\r\n", window, sent, bench_received);
+		return -1;
+	}
+
+	printf("%8u  %10.1f MB/s\r\n", window, BENCH_STREAM_SIZE / elapsed / 1e6);
+
+	return 0;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int window;
+	int failed = 0;
+	csp_thread_handle_t handle;
+
+	csp_buffer_init(200, BENCH_DATA_SIZE + 64);
+	csp_init(BENCH_ADDRESS);
+	csp_route_start_task(1000, 0);
+
+	csp_bin_sem_create(&bench_done);
+	csp_bin_sem_wait(&bench_done, 0);
+	csp_thread_create(bench_sink, (signed char *) "SINK", 1000, NULL, 0, &handle);
+	csp_thread_create(bench_stream_sink, (signed char *) "STREAM", 1000, NULL, 0, &handle);
+
+	printf("  window  loopback throughput, %u byte segments\r\n", BENCH_DATA_SIZE);
+	for (window = 1; window <= CSP_RDP_MAX_WINDOW && window <= CSP_FIFO_INPUT; window *= 2)
+		if (bench_window(window) != 0)
+			failed = 1;
+
+	printf("\r\n  window  loopback stream of %u bytes\r\n", BENCH_STREAM_SIZE);
+	for (window = 1; window <= CSP_RDP_MAX_WINDOW && window <= CSP_FIFO_INPUT; window *= 2)
+		if (bench_stream(window) != 0)
+			failed = 1;
+
+	return failed;
+
+}
@@ -0,0 +1,280 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * RDP parameter sweep benchmark
+ * Sends a fixed number of segments over an RDP connection to a sink on the
+ * same node, once for each setting of window size, segment size, ACK delay
+ * count and injected loss. Each sweep varies one parameter from a common
+ * baseline. Without loss the node talks to itself over csp_if_lo, with loss
+ * over an interface that drops a share of the packets before looping them
+ * back. For every run it reports goodput, retransmissions per MB, the median
+ * and 99th percentile time from csp_send to csp_read, and the most buffers
+ * in use at once, sampled every millisecond. The exit status is nonzero if
+ * any run loses or reorders data, or retransmits anything without loss, so
+ * it can run unattended.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+#include <csp/csp_conn.h>
+#include <csp/csp_interface.h>
+#include <csp/interfaces/csp_if_lo.h>
+#include <csp/arch/csp_thread.h>
+#include <csp/arch/csp_semaphore.h>
+
+#define BENCH_ADDRESS		1		// Address of this node
+#define BENCH_PORT			10		// Port of the sink
+#define BENCH_SEGMENTS		1000	// Segments sent per run
+#define BENCH_TIMEOUT		5000	// Timeout for send and receive in ms
+#define BENCH_BUFFERS		200		// Buffers in the pool
+#define BENCH_BUFFER_SIZE	256		// Size of each buffer
+
+/* Baseline every sweep starts from */
+#define BENCH_WINDOW		8
+#define BENCH_SIZE			200
+#define BENCH_ACK_DELAY		2
+#define BENCH_LOSS			0
+
+/* Header of each segment, the rest is filler */
+typedef struct {
+	uint32_t seq;
+	double sent;
+} bench_stamp_t;
+
+static unsigned int bench_loss;
+static unsigned int bench_seed = 1;
+static csp_iface_t bench_if;
+
+static csp_bin_sem_handle_t bench_done;
+static volatile int bench_running;
+static volatile int bench_min_free;
+static unsigned int bench_received, bench_errors;
+static double bench_latency[BENCH_SEGMENTS];
+static double bench_last;
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_sample_buffers(void) {
+	int remaining = csp_buffer_remaining();
+	if (remaining < bench_min_free)
+		bench_min_free = remaining;
+}
+
+/* Drop bench_loss percent of the packets, and loop the rest back to this node */
+static int bench_tx(csp_packet_t * packet, uint32_t timeout) {
+
+	bench_seed = bench_seed * 1103515245 + 12345;
+	if ((bench_seed >> 16) % 100 < bench_loss) {
+		csp_buffer_free(packet);
+		return CSP_ERR_NONE;
+	}
+
+	csp_new_packet(packet, &bench_if, NULL);
+	return CSP_ERR_NONE;
+
+}
+
+static csp_iface_t bench_if = {
+	.name = "LOSSY",
+	.nexthop = bench_tx,
+};
+
+/* Receive BENCH_SEGMENTS segments per connection, and record their latency */
+CSP_DEFINE_TASK(bench_sink) {
+
+	csp_socket_t * sock = param;
+
+	for (;;) {
+		csp_conn_t * conn = csp_accept(sock, CSP_MAX_DELAY);
+		if (conn == NULL)
+			continue;
+
+		csp_packet_t * packet;
+		while (bench_received < BENCH_SEGMENTS && (packet = csp_read(conn, BENCH_TIMEOUT)) != NULL) {
+			double now = bench_now();
+			bench_stamp_t stamp;
+			memcpy(&stamp, packet->data, sizeof(stamp));
+			if (stamp.seq != bench_received)
+				bench_errors++;
+			bench_latency[bench_received++] = now - stamp.sent;
+			bench_last = now;
+			bench_sample_buffers();
+			csp_buffer_free(packet);
+		}
+
+		csp_close(conn);
+		csp_bin_sem_post(&bench_done);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Sample the buffer pool while a run is in progress */
+CSP_DEFINE_TASK(bench_sampler) {
+
+	for (;;) {
+		if (bench_running)
+			bench_sample_buffers();
+		csp_sleep_ms(1);
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+static int bench_compare(const void * a, const void * b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static int bench_run(unsigned int window, unsigned int size, unsigned int ack_delay, unsigned int loss) {
+
+	unsigned int i, retransmits;
+
+	printf("%8u  %5u  %8u  %3u%%", window, size, ack_delay, loss);
+	fflush(stdout);
+
+	bench_loss = loss;
+	csp_route_set(BENCH_ADDRESS, loss > 0 ? &bench_if : &csp_if_lo, CSP_NODE_MAC);
+	csp_rdp_set_opt(window, 10000, 1000, 1, 50, ack_delay);
+
+	bench_received = 0;
+	bench_errors = 0;
+	bench_min_free = csp_buffer_remaining();
+	int total = bench_min_free;
+	bench_running = 1;
+
+	csp_conn_t * conn = csp_connect(CSP_PRIO_NORM, BENCH_ADDRESS, BENCH_PORT, BENCH_TIMEOUT, CSP_O_RDP);
+	if (conn == NULL) {
+		bench_running = 0;
+		printf("  connect failed\r\n");
+		return -1;
+	}
+
+	double start = bench_now();
+	for (i = 0; i < BENCH_SEGMENTS; i++) {
+		csp_packet_t * packet = csp_buffer_get(size);
+		if (packet == NULL) {
+			csp_sleep_ms(1);
+			i--;
+			continue;
+		}
+		memset(packet->data, i, size);
+		bench_stamp_t stamp = { .seq = i, .sent = bench_now() };
+		memcpy(packet->data, &stamp, sizeof(stamp));
+		packet->length = size;
+		if (!csp_send(conn, packet, BENCH_TIMEOUT)) {
+			csp_buffer_free(packet);
+			break;
+		}
+	}
+
+	csp_bin_sem_wait(&bench_done, BENCH_TIMEOUT * 2);
+	bench_running = 0;
+	retransmits = conn->rdp.fast_retransmits + conn->rdp.timeout_retransmits;
+	csp_close(conn);
+
+	if (bench_received != BENCH_SEGMENTS || bench_errors > 0) {
+		printf("  %u of %u segments received, %u out of order\r\n", bench_received, BENCH_SEGMENTS, bench_errors);
+		return -1;
+	}
+
+	double megabytes = (double) BENCH_SEGMENTS * size / 1e6;
+	qsort(bench_latency, BENCH_SEGMENTS, sizeof(double), bench_compare);
+	printf("  %10.1f  %8.0f  %8.2f  %8.2f  %5d\r\n",
+			megabytes * 1000 / (bench_last - start), retransmits / megabytes,
+			bench_latency[BENCH_SEGMENTS / 2] * 1000, bench_latency[BENCH_SEGMENTS * 99 / 100] * 1000,
+			total - bench_min_free);
+
+	/* Without loss, every retransmission is spurious */
+	if (loss == 0 && retransmits > 0) {
+		printf("  %u retransmits without loss\r\n", retransmits);
+		return -1;
+	}
+
+	return 0;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	static const unsigned int windows[] = {1, 2, 4, 8, 16};
+	static const unsigned int sizes[] = {16, 64, 200};
+	static const unsigned int ack_delays[] = {1, 2, 4};
+	static const unsigned int losses[] = {1, 2, 5};
+	unsigned int i;
+	int failed = 0;
+	csp_thread_handle_t handle;
+
+	csp_buffer_init(BENCH_BUFFERS, BENCH_BUFFER_SIZE);
+	csp_init(BENCH_ADDRESS);
+	csp_route_start_task(1000, 0);
+
+	/* Lost segments are part of the measurement, not worth a log line each */
+	csp_debug_set_level(CSP_WARN, 0);
+
+	csp_bin_sem_create(&bench_done);
+	csp_bin_sem_wait(&bench_done, 0);
+	/* Listen before the first run, or its SYN may arrive before the sink is ready */
+	csp_socket_t * sock = csp_socket(CSP_SO_RDPREQ);
+	csp_bind(sock, BENCH_PORT);
+	csp_listen(sock, 5);
+	csp_thread_create(bench_sink, (signed char *) "SINK", 1000, sock, 0, &handle);
+	csp_thread_create(bench_sampler, (signed char *) "SAMPLER", 1000, NULL, 0, &handle);
+
+	printf("RDP sweep, %u segments per run, %u buffers of %u bytes\r\n",
+			BENCH_SEGMENTS, BENCH_BUFFERS, BENCH_BUFFER_SIZE);
+	printf("  window   size  ackdelay  loss        kB/s   retx/MB    p50 ms    p99 ms   bufs\r\n");
+
+	/* Windows above --with-rdp-max-window are clamped, and the router queue must hold one */
+	for (i = 0; i < sizeof(windows) / sizeof(windows[0]); i++)
+		if (windows[i] <= CSP_RDP_MAX_WINDOW && windows[i] <= CSP_FIFO_INPUT)
+			if (bench_run(windows[i], BENCH_SIZE, windows[i] < BENCH_ACK_DELAY ? windows[i] : BENCH_ACK_DELAY, BENCH_LOSS) != 0)
+				failed = 1;
+
+	printf("\r\n");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		if (bench_run(BENCH_WINDOW, sizes[i], BENCH_ACK_DELAY, BENCH_LOSS) != 0)
+			failed = 1;
+
+	printf("\r\n");
+	for (i = 0; i < sizeof(ack_delays) / sizeof(ack_delays[0]); i++)
+		if (bench_run(BENCH_WINDOW, BENCH_SIZE, ack_delays[i], BENCH_LOSS) != 0)
+			failed = 1;
+
+	printf("\r\n");
+	for (i = 0; i < sizeof(losses) / sizeof(losses[0]); i++)
+		if (bench_run(BENCH_WINDOW, BENCH_SIZE, BENCH_ACK_DELAY, losses[i]) != 0)
+			failed = 1;
+
+	return failed;
+
+}
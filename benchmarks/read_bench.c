@@ -0,0 +1,138 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Batched read benchmark
+ * Measures the cost per packet of taking packets from the RX queue of a
+ * connection with csp_read, and with csp_read_many for a range of batch
+ * sizes. The queue is filled before each measurement, so only the reader
+ * side is timed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <csp/csp.h>
+#include <csp/csp_conn.h>
+
+#define BENCH_ADDRESS		1		// Address of this node
+#define BENCH_ROUNDS		2000	// Queue fills per measurement
+#define BENCH_FILL			CSP_RX_QUEUE_LENGTH	// Packets per queue fill
+
+static csp_conn_t * bench_conn;
+static csp_packet_t * bench_packets[BENCH_FILL];
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_fill(void) {
+
+	unsigned int i;
+
+	for (i = 0; i < BENCH_FILL; i++)
+		if (csp_conn_enqueue_packet(bench_conn, bench_packets[i]) != CSP_ERR_NONE)
+			return -1;
+
+	return 0;
+
+}
+
+/* Read the queue empty with batches of batch packets, 0 for csp_read */
+static double bench_read(unsigned int batch) {
+
+	unsigned int round, read;
+	csp_packet_t * packets[BENCH_FILL];
+	double elapsed = 0;
+
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		if (bench_fill() != 0) {
+			printf("Failed to fill RX queue\r\n");
+			return -1;
+		}
+
+		double start = bench_now();
+		for (read = 0; read < BENCH_FILL;) {
+			if (batch == 0) {
+				if (csp_read(bench_conn, 0) == NULL)
+					break;
+				read++;
+			} else {
+				int count = csp_read_many(bench_conn, packets, batch, 0);
+				if (count == 0)
+					break;
+				read += count;
+			}
+		}
+		elapsed += bench_now() - start;
+
+		if (read != BENCH_FILL) {
+			printf("Only read %u of %u packets\r\n", read, BENCH_FILL);
+			return -1;
+		}
+	}
+
+	return elapsed * 1e9 / (BENCH_ROUNDS * BENCH_FILL);
+
+}
+
+int main(int argc, char * argv[]) {
+
+	unsigned int i, batch;
+	csp_id_t id;
+
+	csp_buffer_init(BENCH_FILL, 300);
+	csp_init(BENCH_ADDRESS);
+
+	id.ext = 0;
+	id.pri = CSP_PRIO_NORM;
+	id.src = 2;
+	id.dst = BENCH_ADDRESS;
+	id.sport = 10;
+	id.dport = 20;
+	bench_conn = csp_conn_new(id, id);
+	if (bench_conn == NULL) {
+		printf("Failed to create connection\r\n");
+		return 1;
+	}
+
+	for (i = 0; i < BENCH_FILL; i++) {
+		bench_packets[i] = csp_buffer_get(8);
+		if (bench_packets[i] == NULL) {
+			printf("Failed to get buffer %u\r\n", i);
+			return 1;
+		}
+		bench_packets[i]->id = id;
+		bench_packets[i]->length = 8;
+	}
+
+	printf("Reading %u queued packets\r\n", BENCH_FILL);
+	printf("   batch     per packet\r\n");
+	printf("csp_read  %9.1f ns\r\n", bench_read(0));
+	for (batch = 1; batch <= BENCH_FILL; batch *= 4)
+		printf("%8u  %9.1f ns\r\n", batch, bench_read(batch));
+
+	return 0;
+
+}
@@ -0,0 +1,5 @@
+#include <stdbool.h>
+
+int main() {
+	return 0;
+}
@@ -0,0 +1,48 @@
+AR = 'ar'
+ARFLAGS = 'rcs'
+BINDIR = '/usr/local/bin'
+CC = ['gcc']
+CCLNK_SRC_F = []
+CCLNK_TGT_F = ['-o']
+CC_NAME = 'gcc'
+CC_SRC_F = []
+CC_TGT_F = ['-c', '-o']
+CC_VERSION = ('12', '2', '0')
+CFLAGS = ['-Os', '-Wall', '-g', '-std=gnu99']
+CFLAGS_MACBUNDLE = ['-fPIC']
+CFLAGS_cshlib = ['-fPIC']
+CPPPATH_ST = '-I%s'
+DEFINES = []
+DEFINES_ST = '-D%s'
+DEST_BINFMT = 'elf'
+DEST_CPU = 'x86_64'
+DEST_OS = 'linux'
+ENABLE_BENCHMARKS = True
+ENABLE_BINDINGS = None
+ENABLE_EXAMPLES = True
+ENABLE_RDP = True
+EXCL_CSP = ['src/arch/posix/ring_queue.c']
+FILES_CSP = ['src/*.c', 'src/interfaces/csp_if_lo.c', 'src/transport/csp_udp.c', 'src/arch/posix/**/*.c', 'src/drivers/can/can_socketcan.c', 'src/drivers/usart/usart_linux.c', 'src/interfaces/csp_if_can.c', 'src/interfaces/csp_if_kiss.c', 'src/csp_debug.c', 'src/transport/csp_rdp.c', 'src/csp_crc32.c', 'src/crypto/csp_hmac.c', 'src/crypto/csp_sha1.c', 'src/crypto/csp_xtea.c']
+INCLUDES_CSP = ['include', '', '../../libgomspace/include']
+LIBDIR = '/usr/local/lib'
+LIBPATH_ST = '-L%s'
+LIB_ST = '-l%s'
+LINKFLAGS_MACBUNDLE = ['-bundle', '-undefined', 'dynamic_lookup']
+LINKFLAGS_cshlib = ['-shared']
+LINKFLAGS_cstlib = ['-Wl,-Bstatic']
+LINK_CC = ['gcc']
+OS = ['posix']
+PREFIX = '/usr/local'
+RPATH_ST = '-Wl,-rpath,%s'
+SHLIB_MARKER = '-Wl,-Bdynamic'
+SIZE = 'size'
+SONAME_ST = '-Wl,-h,%s'
+STLIBPATH_ST = '-L%s'
+STLIB_MARKER = '-Wl,-Bstatic'
+STLIB_ST = '-l%s'
+cfg_files = ['/root/repo/build/include/csp/csp_autoconfig.h']
+cprogram_PATTERN = '%s'
+cshlib_PATTERN = 'lib%s.so'
+cstlib_PATTERN = 'lib%s.a'
+define_key = []
+macbundle_PATTERN = '%s.bundle'
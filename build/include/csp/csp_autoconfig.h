@@ -0,0 +1,41 @@
+/* WARNING! All changes made to this file will be lost! */
+
+#ifndef _INCLUDE_CSP_CSP_AUTOCONFIG_H_WAF
+#define _INCLUDE_CSP_CSP_AUTOCONFIG_H_WAF
+
+#define GIT_REV "25132f2"
+/* #undef CSP_FREERTOS */
+#define CSP_POSIX 1
+/* #undef CSP_WINDOWS */
+/* #undef CSP_MACOSX */
+/* #undef CSP_POSIX_RING_QUEUE */
+#define CSP_DEBUG 1
+/* #undef CSP_DISABLE_OUTPUT */
+#define CSP_VERBOSE 1
+#define CSP_USE_RDP 1
+#define CSP_USE_CRC32 1
+#define CSP_USE_HMAC 1
+#define CSP_USE_XTEA 1
+#define CSP_USE_PROMISC 1
+#define CSP_USE_QOS 1
+/* #undef CSP_USE_EVENTFD */
+#define CSP_CONN_MAX 10
+#define CSP_CONN_QUEUE_LENGTH 100
+#define CSP_FIFO_INPUT 10
+#define CSP_ROUTER_BATCH 1
+#define CSP_ROUTER_WORKERS 1
+#define CSP_MAX_BIND_PORT 31
+#define CSP_RDP_MAX_WINDOW 20
+#define CSP_RDP_QUARANTINE 0
+#define CSP_PADDING_BYTES 8
+/* #undef CSP_USE_BUFFER_CACHE */
+#define CSP_BUFFER_CACHE_SIZE 0
+#define CSP_LOG_LEVEL_DEBUG 1
+#define CSP_LOG_LEVEL_INFO 1
+#define CSP_LOG_LEVEL_WARN 1
+#define CSP_LOG_LEVEL_ERROR 1
+#define CSP_LITTLE_ENDIAN 1
+/* #undef CSP_BIG_ENDIAN */
+#define CSP_HAVE_STDBOOL_H 1
+
+#endif /* _INCLUDE_CSP_CSP_AUTOCONFIG_H_WAF */
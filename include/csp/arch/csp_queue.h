@@ -38,6 +38,7 @@ void csp_queue_remove(csp_queue_handle_t queue);
 int csp_queue_enqueue(csp_queue_handle_t handle, void *value, uint32_t timeout);
 int csp_queue_enqueue_isr(csp_queue_handle_t handle, void * value, CSP_BASE_TYPE * task_woken);
 int csp_queue_dequeue(csp_queue_handle_t handle, void *buf, uint32_t timeout);
+int csp_queue_dequeue_many(csp_queue_handle_t handle, void *buf, int count, uint32_t timeout);
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE * task_woken);
 int csp_queue_size(csp_queue_handle_t handle);
 int csp_queue_size_isr(csp_queue_handle_t handle);
@@ -167,6 +167,7 @@ typedef union {
 #define CSP_SO_CRC32REQ		0x0040				// Require CRC32
 #define CSP_SO_CRC32PROHIB	0x0080				// Prohibit CRC32
 #define CSP_SO_CONN_LESS	0x0100				// Enable Connection Less mode
+#define CSP_SO_RDPFASTOPEN	0x0200				// Send the first RDP segment with the SYN
 
 /** CSP Connect options */
 #define CSP_O_NONE  		CSP_SO_NONE			// No connection options
@@ -178,6 +179,7 @@ typedef union {
 #define CSP_O_NOXTEA		CSP_SO_XTEAPROHIB	// Disable XTEA
 #define CSP_O_CRC32			CSP_SO_CRC32REQ		// Enable CRC32
 #define CSP_O_NOCRC32		CSP_SO_CRC32PROHIB	// Disable CRC32
+#define CSP_O_RDPFASTOPEN	CSP_SO_RDPFASTOPEN	// Enable RDP fast open, if the peer is known to support it
 
 /**
  * CSP PACKET STRUCTURE
@@ -199,13 +201,25 @@ typedef struct __attribute__((__packed__)) {
 /** Next hop function prototype */
 typedef int (*nexthop_t)(csp_packet_t *packet, uint32_t timeout);
 
-/** Interface struct */
+/**
+ * Interface struct
+ *
+ * Packets held in the RDP retransmit window are shared buffers, and
+ * csp_send_direct() only passes them on without a copy when the interface
+ * sets tx_shared and no HMAC, CRC32 or XTEA trailer is appended. Only CAN
+ * sets tx_shared: KISS and I2C write their framing into the packet, and
+ * loopback hands the buffer to the local receiver, which strips trailers
+ * and may reuse it for a reply. So every RDP segment sent over these
+ * interfaces, or with security trailers, is copied.
+ */
 typedef struct csp_iface_s {
 	const char *name;			/**< Interface name (keep below 10 bytes)*/
 	nexthop_t nexthop; 			/**< Next hop function */
 	uint8_t promisc;			/**< Promiscuous mode enabled */
 	uint16_t mtu;				/**< Maximum Transmission Unit of interface */
 	uint8_t split_horizon_off;	/**< Disable the route-loop prevention on if */
+	uint8_t tx_shared;			/**< nexthop never modifies the packet, so shared buffers are sent without a copy */
+	uint8_t rx_small;			/**< Received packets may be small buffers, the applications never reuse them for larger replies */
 	uint32_t tx;				/**< Successfully transmitted packets */
 	uint32_t rx;				/**< Successfully received packets */
 	uint32_t tx_error;			/**< Transmit errors */
@@ -226,6 +240,16 @@ typedef struct csp_iface_s {
  */
 #define CSP_BUFFER_PACKET_OVERHEAD 	(sizeof(csp_packet_t) - sizeof(((csp_packet_t *)0)->data))
 
+/**
+ * Every packet returned by csp_read(), csp_recvfrom() or passed to a port
+ * callback is csp_buffer_size() bytes, whatever size classes are configured,
+ * so a handler may write a reply of up to csp_buffer_size() -
+ * CSP_BUFFER_PACKET_OVERHEAD bytes into the request packet and send it back.
+ * The exception is an interface with rx_small set, whose packets may come
+ * from a smaller class. Small packets arriving on any other interface, such
+ * as loopback, are copied into a full size buffer by csp_new_packet().
+ */
+
 /** Forward declaration of socket and connection structures */
 typedef struct csp_conn_s csp_socket_t;
 typedef struct csp_conn_s csp_conn_t;
@@ -291,6 +315,21 @@ csp_conn_t *csp_accept(csp_socket_t *socket, uint32_t timeout);
  */
 csp_packet_t *csp_read(csp_conn_t *conn, uint32_t timeout);
 
+/**
+ * Read several packets from a connection
+ * Blocks like csp_read until the first packet arrives, then takes the packets
+ * that are already waiting, up to count, without waiting again. With QoS the
+ * packets are returned highest priority first, as repeated csp_read calls would,
+ * and at most CSP_CONN_QUEUE_LENGTH are read per call.
+ * Do NOT call this from ISR
+ * @param conn pointer to connection
+ * @param packets array of at least count packet pointers, which you MUST free yourself
+ * @param count maximum number of packets to read
+ * @param timeout timeout in ms for the first packet, use CSP_MAX_DELAY for infinite blocking time
+ * @return number of packets stored in packets, 0 if timeout was reached or the connection has been closed
+ */
+int csp_read_many(csp_conn_t *conn, csp_packet_t **packets, unsigned int count, uint32_t timeout);
+
 /**
  * Send a packet on an already established connection
  * @param conn pointer to connection
@@ -352,6 +391,19 @@ int csp_transaction_persistent(csp_conn_t *conn, uint32_t timeout, void *outbuf,
  */
 csp_packet_t *csp_recvfrom(csp_socket_t *socket, uint32_t timeout);
 
+/**
+ * Read several packets from a connection-less server socket
+ * Blocks like csp_recvfrom until the first packet arrives, then takes the
+ * packets that are already waiting, up to count, without waiting again.
+ * Do NOT call this from ISR
+ * @param socket connection-less socket
+ * @param packets array of at least count packet pointers, which you MUST free yourself
+ * @param count maximum number of packets to read
+ * @param timeout timeout in ms for the first packet, use CSP_MAX_DELAY for infinite blocking time
+ * @return number of packets stored in packets, 0 if timeout was reached
+ */
+int csp_recvfrom_many(csp_socket_t *socket, csp_packet_t **packets, unsigned int count, uint32_t timeout);
+
 /**
  * Send a packet without previously opening a connection
  * @param prio CSP_PRIO_x
@@ -365,6 +417,83 @@ csp_packet_t *csp_recvfrom(csp_socket_t *socket, uint32_t timeout);
  */
 int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t *packet, uint32_t timeout);
 
+/** Data block for csp_sendv and csp_sendtov */
+typedef struct {
+	const void *base;		/**< Start of the block */
+	size_t len;				/**< Number of bytes in the block */
+} csp_iovec_t;
+
+/**
+ * Send data gathered from several blocks on a connection
+ * The blocks are copied once, straight into packet buffers. Data that does not
+ * fit in the largest buffer and the MTU of the outgoing interface is split
+ * into several packets. Nothing is sent if the blocks are empty.
+ * @param conn pointer to connection
+ * @param iov array of blocks to send, in order
+ * @param iovcnt number of blocks in iov
+ * @param timeout timeout in ms for each packet to get a buffer and, on RDP connections, window space
+ * @return number of bytes sent, which is less than the total on timeout or reset,
+ * CSP_ERR_NOMEM if there is no buffer for the first packet, or another negative CSP_ERR code on invalid arguments
+ */
+int csp_sendv(csp_conn_t *conn, const csp_iovec_t *iov, unsigned int iovcnt, uint32_t timeout);
+
+/**
+ * Send data gathered from several blocks without a connection
+ * Like csp_sendv, but for a connection-less socket. Data split into several
+ * packets arrives as separate packets, which the receiver must put together.
+ * @param prio CSP_PRIO_x
+ * @param dest destination node
+ * @param dport destination port
+ * @param src_port source port
+ * @param opts CSP_O_x, except CSP_O_RDP
+ * @param iov array of blocks to send, in order
+ * @param iovcnt number of blocks in iov
+ * @param timeout timeout in ms for each packet to get a buffer, and used by interfaces with blocking send
+ * @return number of bytes sent, which is less than the total on timeout or send error,
+ * CSP_ERR_NOMEM if there is no buffer for the first packet, or another negative CSP_ERR code on invalid arguments
+ */
+int csp_sendtov(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, const csp_iovec_t *iov, unsigned int iovcnt, uint32_t timeout);
+
+/** Events for csp_poll */
+#define CSP_POLLIN			0x01	/**< Connection has a packet for csp_read, or has been closed */
+#define CSP_POLLACCEPT		0x02	/**< Socket has a connection for csp_accept, or a packet for csp_recvfrom */
+
+/** Connection or socket to wait on with csp_poll */
+typedef struct {
+	csp_conn_t *conn;		/**< Connection for CSP_POLLIN, socket for CSP_POLLACCEPT. NULL entries are ignored */
+	uint8_t events;			/**< Events to wait for */
+	uint8_t revents;		/**< Events that are ready, set by csp_poll */
+} csp_pollfd_t;
+
+/**
+ * Wait until one of a set of connections and sockets is ready
+ * Lets a single task serve many connections: wait here, then call csp_read,
+ * csp_accept or csp_recvfrom with a timeout of 0 on the entries that are ready.
+ * A connection or socket can only be polled by one task at a time. If another
+ * task is blocked polling one of the entries, CSP_ERR_BUSY is returned at once.
+ * Do NOT call this from ISR
+ * @param fds array of connections and sockets with the events to wait for
+ * @param nfds number of entries in fds
+ * @param timeout timeout in ms, use CSP_MAX_DELAY for infinite blocking time
+ * @return number of entries with revents set, 0 if timeout was reached, or a negative CSP_ERR code
+ */
+int csp_poll(csp_pollfd_t *fds, unsigned int nfds, uint32_t timeout);
+
+/**
+ * Get a file descriptor that is readable while a connection or socket is ready
+ * The descriptor can be added to an epoll or select set. It becomes readable on
+ * the same events as csp_poll, including the rest of a segment that
+ * csp_rdp_recv_stream has partly read. It stays readable until csp_read,
+ * csp_accept or csp_recvfrom has emptied the queue, so drain it with a timeout
+ * of 0. The descriptor is only written when the queue stops being empty. Do not
+ * read from the descriptor yourself. It belongs to the connection slot, so
+ * remove it from the set before calling csp_close.
+ * Requires --enable-eventfd
+ * @param conn pointer to connection or socket
+ * @return file descriptor, or a negative CSP_ERR code
+ */
+int csp_conn_fd(csp_conn_t *conn);
+
 /**
  * Send a packet as a direct reply to the source of an incoming packet,
  * but still without holding an entire connection
@@ -443,6 +572,40 @@ int csp_listen(csp_socket_t *socket, size_t conn_queue_length);
  */
 int csp_bind(csp_socket_t *socket, uint8_t port);
 
+/**
+ * Callback for packets to a port bound with csp_bind_callback
+ * @param packet incoming packet, which the callback MUST free or reuse, e.g. for csp_sendto_reply
+ * @param ctx context given to csp_bind_callback
+ */
+typedef void (*csp_callback_t)(csp_packet_t *packet, void *ctx);
+
+/**
+ * Bind port to a callback
+ * The router calls the callback for every packet to the port, after the
+ * security check, instead of queueing it to a socket or connection. This saves
+ * the queue hops and the wakeup of a server task, so it suits short handlers
+ * like ping or time sync. No connection is created, so reply with
+ * csp_sendto_reply. Packets from connections without RDP are delivered the
+ * same way as connection-less packets. RDP needs a connection of its own and
+ * cannot be bound to a callback; RDP packets to the port are discarded.
+ * HMAC, XTEA and CRC32 are verified when the packet carries them, and
+ * required as given in opts, like for a socket.
+ *
+ * The callback runs in the router task, and must return quickly:
+ * - Do NOT block. Send with a timeout of 0, and never call csp_read,
+ *   csp_accept, csp_transaction or csp_connect with RDP, as they wait for the router.
+ * - With several router workers, the callback may run in more than one of
+ *   them at the same time, so it must be reentrant.
+ * - Packets for other ports are not routed while the callback runs.
+ *
+ * @param port Port number to bind, or CSP_ANY
+ * @param opts socket options, CSP_SO_HMACREQ, CSP_SO_XTEAREQ and CSP_SO_CRC32REQ. CSP_SO_RDPREQ is not supported
+ * @param callback Function to call for each packet
+ * @param ctx Passed to the callback
+ * @return CSP_ERR_NONE on success, CSP_ERR_NOTSUP for RDP or options not compiled in, or another negative CSP_ERR code
+ */
+int csp_bind_callback(uint8_t port, uint32_t opts, csp_callback_t callback, void *ctx);
+
 /**
  * Set route
  * This function maintains the routing table,
@@ -615,6 +778,77 @@ void csp_rdp_get_opt(unsigned int *window_size, unsigned int *conn_timeout_ms,
 		unsigned int *packet_timeout_ms, unsigned int *delayed_acks,
 		unsigned int *ack_timeout, unsigned int *ack_delay_count);
 
+/**
+ * Set RDP retransmission timeout bounds
+ * Each connection estimates its round trip time and derives the retransmission
+ * timeout from it, starting out from the packet timeout. The timeout is kept
+ * between these bounds. Setting both to the packet timeout disables adaptation.
+ * @param rto_min_ms Lowest retransmission timeout in ms
+ * @param rto_max_ms Highest retransmission timeout in ms, also limits backoff
+ */
+void csp_rdp_set_rto(unsigned int rto_min_ms, unsigned int rto_max_ms);
+
+/**
+ * Get RDP retransmission timeout bounds
+ * @param rto_min_ms Lowest retransmission timeout in ms
+ * @param rto_max_ms Highest retransmission timeout in ms
+ */
+void csp_rdp_get_rto(unsigned int *rto_min_ms, unsigned int *rto_max_ms);
+
+/**
+ * Set RDP fast retransmit threshold
+ * A segment is retransmitted as soon as EACKs show that this many later
+ * segments have arrived, instead of waiting for the retransmission timeout.
+ * Applies to new connections. The default is 3, so a few segments delivered
+ * out of order do not cause spurious retransmissions. With a window of 3 or
+ * less, lower it to 1 or only timeouts will recover losses.
+ * @param threshold Number of later segments, 0 to only retransmit on timeout
+ */
+void csp_rdp_set_fast_retransmit(unsigned int threshold);
+
+/** RDP congestion control flags */
+#define CSP_RDP_CC_AIMD			0x01 /**< Limit segments in flight with an additive increase, multiplicative decrease window */
+#define CSP_RDP_CC_PACING		0x02 /**< Spread new segments over the round trip time instead of sending bursts */
+
+/**
+ * Set RDP congestion control
+ * With AIMD, a connection starts with a window of two segments and opens it as
+ * ACKs arrive, up to the window size. Loss detected by EACKs halves the window,
+ * and a retransmission timeout drops it to one segment. With pacing, new
+ * segments are sent at most once every round trip time divided by the window.
+ * This keeps several connections from overrunning a slow shared link. Applies to
+ * new connections. The default is 0.
+ * @param flags CSP_RDP_CC flags, 0 to only limit by the window size
+ */
+void csp_rdp_set_cc(unsigned int flags);
+
+/**
+ * Send a buffer over an RDP connection
+ * The buffer is split into the largest segments that fit in a CSP buffer and
+ * the MTU of the outgoing interface. Segments are queued as long as the window
+ * has room, so the window stays full until the whole buffer is sent.
+ * @param conn pointer to an RDP connection
+ * @param buf data to send
+ * @param len number of bytes to send
+ * @param timeout timeout in ms for each segment to get a buffer and window space
+ * @return number of bytes sent, which is less than len on timeout or reset, CSP_ERR_NOMEM if there is
+ * no buffer for the first segment, or another negative CSP_ERR code on invalid arguments
+ */
+int csp_rdp_send_stream(csp_conn_t *conn, const void *buf, size_t len, uint32_t timeout);
+
+/**
+ * Receive a buffer from an RDP connection
+ * Segments are copied into the buffer until it is full. A segment that does
+ * not fit entirely is kept by the connection, and the rest of it is returned
+ * by the next call.
+ * @param conn pointer to an RDP connection
+ * @param buf buffer to receive into
+ * @param len number of bytes to receive
+ * @param timeout timeout in ms to wait for each segment
+ * @return number of bytes received, which is less than len on timeout or when the other end closes, or a negative CSP_ERR code on invalid arguments
+ */
+int csp_rdp_recv_stream(csp_conn_t *conn, void *buf, size_t len, uint32_t timeout);
+
 /**
  * Set XTEA key
  * @param key Pointer to key array
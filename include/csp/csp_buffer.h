@@ -25,6 +25,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 extern "C" {
 #endif
 
+/** Maximum number of buffer size classes */
+#define CSP_BUFFER_CLASSES_MAX	4
+
+/** Buffer size class */
+typedef struct {
+	int count;		/**< Number of buffers in the class */
+	int size;		/**< Buffer size in bytes */
+} csp_buffer_class_t;
+
 /**
  * Start the buffer handling system
  * You must specify the number for buffers and the size. All buffers are fixed
@@ -37,15 +46,55 @@ extern "C" {
  */
 int csp_buffer_init(int count, int size);
 
+/**
+ * Start the buffer handling system with several buffer sizes
+ * Each class is a separate pool of fixed size buffers. csp_buffer_get() always
+ * returns a buffer of the largest class, so every packet the application gets
+ * can be reused for a reply of any size. csp_buffer_get_small(),
+ * csp_buffer_get_small_timeout() and csp_buffer_clone() use the smaller
+ * classes. Calling csp_buffer_init() is equal to using a single class.
+ *
+ * @param classes Array of size classes, in any order
+ * @param class_count Number of classes, at most CSP_BUFFER_CLASSES_MAX
+ *
+ * @return CSP_ERR_NONE if malloc() succeeded, CSP_ERR message otherwise.
+ */
+int csp_buffer_init_classes(const csp_buffer_class_t * classes, int class_count);
+
 /**
  * Get a reference to a free buffer. This function can only be called
- * from task context.
+ * from task context. The buffer is of the largest size, csp_buffer_size(),
+ * whatever the requested size.
  *
  * @param size Specify what data-size you will put in the buffer
  * @return pointer to a free csp_packet_t or NULL if out of memory
  */
 void * csp_buffer_get(size_t size);
 
+/**
+ * Get a reference to a free buffer that may be smaller than csp_buffer_size().
+ * The buffer comes from the smallest class that fits size bytes of data with
+ * room for transport and security trailers, or from a larger class if that is
+ * exhausted. The data must never grow beyond size, so only use it for packets
+ * that are sent and not reused, or received on an interface with rx_small set.
+ * This function can only be called from task context.
+ *
+ * @param size Largest data-size you will put in the buffer
+ * @return pointer to a free csp_packet_t or NULL if out of memory
+ */
+void * csp_buffer_get_small(size_t size);
+
+/**
+ * Like csp_buffer_get_small(), but wait for a buffer to be freed if every
+ * class that fits is empty. The wait is on the best fitting class.
+ * This function can only be called from task context.
+ *
+ * @param size Largest data-size you will put in the buffer
+ * @param timeout timeout in ms to wait for a buffer, use CSP_MAX_DELAY for infinite blocking time
+ * @return pointer to a free csp_packet_t or NULL on timeout
+ */
+void * csp_buffer_get_small_timeout(size_t size, uint32_t timeout);
+
 /**
  * Get a reference to a free buffer. This function can only be called
  * from interrupt context.
@@ -56,32 +105,62 @@ void * csp_buffer_get(size_t size);
 void * csp_buffer_get_isr(size_t buf_size);
 
 /**
- * Free a buffer after use.
+ * Free a buffer after use. If more references were taken with
+ * csp_buffer_ref(), only one reference is released.
  * @param packet pointer to memory area, must be acquired by csp_buffer_get().
  */
 void csp_buffer_free(void *packet);
 
 /**
- * Free a buffer after use in ISR context.
+ * Free a buffer after use in ISR context. Like csp_buffer_free(), this drops
+ * one reference, and the buffer is returned to the pool with the last one.
  * @param packet pointer to memory area, must be acquired by csp_buffer_get().
  */
 void csp_buffer_free_isr(void *packet);
 
 /**
- * Clone an existing packet and increase/decrease cloned packet size.
+ * Take an additional reference to a buffer. The buffer is returned to the
+ * pool when csp_buffer_free() has been called once for every reference.
+ * Shared buffers must be treated as read-only.
+ * @param packet pointer to memory area, must be acquired by csp_buffer_get().
+ * @return packet, or NULL if the buffer is not in use
+ */
+void * csp_buffer_ref(void *packet);
+
+/**
+ * Return the number of references held to a buffer.
+ * @param packet pointer to memory area, must be acquired by csp_buffer_get().
+ * @return number of references, 0 if the buffer is free or unknown
+ */
+int csp_buffer_refcount(void *packet);
+
+/**
+ * Clone an existing packet. Only the packet header and the first length
+ * bytes of data are copied, into the smallest buffer that fits them, so the
+ * clone must not grow beyond the length of the original.
  * @param buffer Existing buffer to clone.
  */
 void * csp_buffer_clone(void *buffer);
 
 /**
  * Return how many buffers that are currently free.
+ * Free buffers parked in per-thread caches (--with-buffer-cache) are included,
+ * although only the thread that holds them can get them. csp_buffer_get() may
+ * therefore fail in one thread while this returns more than zero.
  * @return number of free buffers
  */
 int csp_buffer_remaining(void);
 
+/**
+ * Return the element size of the class a buffer belongs to.
+ * @param packet pointer to memory area, must be acquired by csp_buffer_get().
+ * @return element size in bytes, 0 if the buffer is unknown
+ */
+int csp_buffer_element_size(void *packet);
+
 /**
  * Return the size of the CSP buffers
- * @return size of CSP buffers
+ * @return size of the largest class of CSP buffers
  */
 int csp_buffer_size(void);
 
@@ -62,6 +62,8 @@ typedef struct {
 	uint16_t rcv_cur; 					/**< The sequence number of the last segment received correctly and in sequence */
 	uint16_t rcv_irs; 					/**< The initial receive sequence number */
 	uint16_t rcv_lsa; 					/**< The last sequence number acknowledged by the receiver */
+	uint16_t snd_edge;					/**< The last sequence number the receiver has advertised room for */
+	uint16_t rcv_edge;					/**< The last sequence number advertised to the sender */
 	uint32_t window_size;
 	uint32_t conn_timeout;
 	uint32_t packet_timeout;
@@ -69,9 +71,28 @@ typedef struct {
 	uint32_t ack_timeout;
 	uint32_t ack_delay_count;
 	uint32_t ack_timestamp;
+	uint32_t options;					/**< Options agreed with the other end in the SYN exchange */
+	uint32_t fastopen;					/**< Fast open progress, the SYN waits for or has carried the first segment */
+	uint32_t peer_reset;				/**< The other end closed the connection, userspace has yet to close it */
+	uint32_t rtt_valid;					/**< srtt and rttvar hold a measurement, which can be 0 on fast links */
+	uint32_t srtt;						/**< Smoothed round trip time in ms, scaled by 8 */
+	uint32_t rttvar;					/**< Round trip time variation in ms, scaled by 4 */
+	uint32_t rto;						/**< Current retransmission timeout in ms */
+	uint32_t fast_retransmit;			/**< Out of order segments after a missing one that trigger its retransmission, 0 to disable */
+	uint32_t fast_retransmits;			/**< Segments retransmitted on EACK evidence */
+	uint32_t timeout_retransmits;		/**< Segments retransmitted on timeout */
+	uint32_t cc;						/**< Congestion control, CSP_RDP_CC flags */
+	uint32_t cwnd;						/**< Congestion window in segments, limits window_size */
+	uint32_t ssthresh;					/**< Slow start threshold in segments */
+	uint32_t cwnd_acked;				/**< Segments ACKed towards the next congestion window increase */
+	uint16_t recover;					/**< snd_nxt when loss was last detected, no new reduction before it is ACKed */
+	uint32_t tx_last;					/**< Time the last new segment was sent, used for pacing */
+	csp_packet_t * rx_stream;			/**< Segment partly consumed by csp_rdp_recv_stream */
+	uint16_t rx_stream_offset;			/**< Bytes of rx_stream already consumed */
 	csp_bin_sem_handle_t tx_wait;
-	csp_queue_handle_t tx_queue;
-	csp_queue_handle_t rx_queue;
+	csp_packet_t * tx_window[CSP_RDP_MAX_WINDOW];		/**< Unacknowledged segments, indexed by seq % CSP_RDP_MAX_WINDOW */
+	uint8_t tx_retries[CSP_RDP_MAX_WINDOW];				/**< Number of retransmissions of each segment in tx_window */
+	csp_packet_t * rx_window[CSP_RDP_MAX_WINDOW * 2];	/**< Out of order segments, indexed by seq % (2 * CSP_RDP_MAX_WINDOW) */
 } csp_rdp_t;
 
 /** @brief Connection struct */
@@ -86,8 +107,17 @@ struct csp_conn_s {
 #endif
 	csp_queue_handle_t rx_queue[CSP_RX_QUEUES]; /* Queue for RX packets */
 	csp_queue_handle_t socket;		/* Socket to be "woken" when first packet is ready */
+	csp_conn_t * listener;			/* Socket the connection arrived on, notified when it is queued */
+	csp_bin_sem_handle_t * poll;	/* Semaphore of the task waiting in csp_poll, or NULL */
+#ifdef CSP_USE_EVENTFD
+	int eventfd;					/* Readable while the RX queue, or socket queue, is not empty */
+	uint32_t signalled;				/* The eventfd has been written since it was last cleared */
+#endif
 	uint32_t timestamp;				/* Time the connection was opened */
 	uint32_t opts;					/* Connection or socket options */
+	csp_conn_t * next;				/* Next connection in hash bucket or free list */
+	uint32_t deadline;				/* Time of next timeout check */
+	int timer;						/* Position in timer heap, or -1 if not scheduled */
 #ifdef CSP_USE_RDP
 	csp_rdp_t rdp;					/* RDP state */
 #endif
@@ -96,11 +126,18 @@ struct csp_conn_s {
 int csp_conn_lock(csp_conn_t * conn, uint32_t timeout);
 int csp_conn_unlock(csp_conn_t * conn);
 int csp_conn_enqueue_packet(csp_conn_t * conn, csp_packet_t * packet);
+void csp_conn_notify(csp_conn_t * conn);
+int csp_conn_poll_add(csp_conn_t * conn, csp_bin_sem_handle_t * sem);
+void csp_conn_poll_remove(csp_conn_t * conn, csp_bin_sem_handle_t * sem);
+void csp_conn_rearm(csp_conn_t * conn, csp_queue_handle_t queue);
 int csp_conn_init(void);
 csp_conn_t * csp_conn_allocate(csp_conn_type_t type);
 csp_conn_t * csp_conn_find(uint32_t id, uint32_t mask);
 csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout);
-void csp_conn_check_timeouts(void);
+void csp_conn_check_timeouts(int worker);
+void csp_conn_schedule(csp_conn_t * conn, uint32_t deadline);
+void csp_conn_unschedule(csp_conn_t * conn);
+uint32_t csp_conn_next_timeout(int worker, uint32_t max);
 int csp_conn_get_rxq(int prio);
 
 #ifdef __cplusplus
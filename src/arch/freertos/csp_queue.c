@@ -53,6 +53,13 @@ int csp_queue_dequeue(csp_queue_handle_t handle, void * buf, uint32_t timeout) {
 	return xQueueReceive(handle, buf, timeout);
 }
 
+int csp_queue_dequeue_many(csp_queue_handle_t handle, void * buf, int count, uint32_t timeout) {
+	/* The item size of a FreeRTOS queue is not known here, so take one at a time */
+	if (count < 1)
+		return 0;
+	return csp_queue_dequeue(handle, buf, timeout) == pdTRUE ? 1 : 0;
+}
+
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE * task_woken) {
 	return xQueueReceiveFromISR(handle, buf, (signed CSP_BASE_TYPE *)task_woken);
 }
@@ -24,20 +24,37 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 /* CSP includes */
 #include <csp/csp.h>
 
-#include "pthread_queue.h"
 #include <csp/arch/csp_queue.h>
 
+#ifdef CSP_POSIX_RING_QUEUE
+#include "ring_queue.h"
+#define queue_create	ring_queue_create
+#define queue_delete	ring_queue_delete
+#define queue_enqueue	ring_queue_enqueue
+#define queue_dequeue	ring_queue_dequeue
+#define queue_dequeue_many	ring_queue_dequeue_many
+#define queue_items		ring_queue_items
+#else
+#include "pthread_queue.h"
+#define queue_create	pthread_queue_create
+#define queue_delete	pthread_queue_delete
+#define queue_enqueue	pthread_queue_enqueue
+#define queue_dequeue	pthread_queue_dequeue
+#define queue_dequeue_many	pthread_queue_dequeue_many
+#define queue_items		pthread_queue_items
+#endif
+
 
 csp_queue_handle_t csp_queue_create(int length, size_t item_size) {
-	return pthread_queue_create(length, item_size);
+	return queue_create(length, item_size);
 }
 
 void csp_queue_remove(csp_queue_handle_t queue) {
-	return pthread_queue_delete(queue);
+	return queue_delete(queue);
 }
 
 int csp_queue_enqueue(csp_queue_handle_t handle, void *value, uint32_t timeout) {
-	return pthread_queue_enqueue(handle, value, timeout);
+	return queue_enqueue(handle, value, timeout);
 }
 
 int csp_queue_enqueue_isr(csp_queue_handle_t handle, void * value, CSP_BASE_TYPE * task_woken) {
@@ -47,7 +64,11 @@ int csp_queue_enqueue_isr(csp_queue_handle_t handle, void * value, CSP_BASE_TYPE
 }
 
 int csp_queue_dequeue(csp_queue_handle_t handle, void *buf, uint32_t timeout) {
-	return pthread_queue_dequeue(handle, buf, timeout);
+	return queue_dequeue(handle, buf, timeout);
+}
+
+int csp_queue_dequeue_many(csp_queue_handle_t handle, void *buf, int count, uint32_t timeout) {
+	return queue_dequeue_many(handle, buf, count, timeout);
 }
 
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void *buf, CSP_BASE_TYPE * task_woken) {
@@ -56,9 +77,9 @@ int csp_queue_dequeue_isr(csp_queue_handle_t handle, void *buf, CSP_BASE_TYPE *
 }
 
 int csp_queue_size(csp_queue_handle_t handle) {
-	return pthread_queue_items(handle);
+	return queue_items(handle);
 }
 
 int csp_queue_size_isr(csp_queue_handle_t handle) {
-	return pthread_queue_items(handle);
+	return queue_items(handle);
 }
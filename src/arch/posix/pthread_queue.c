@@ -96,6 +96,11 @@ int pthread_queue_enqueue(pthread_queue_t * queue, void * value, uint32_t timeou
 	/* Get queue lock */
 	pthread_mutex_lock(&(queue->mutex));
 	while (queue->items == queue->size) {
+		/* A wait that has already expired still costs the timer slack */
+		if (timeout == 0) {
+			pthread_mutex_unlock(&(queue->mutex));
+			return PTHREAD_QUEUE_FULL;
+		}
 		ret = pthread_cond_timedwait(&(queue->cond_full), &(queue->mutex), &ts);
 		if (ret != 0) {
 			pthread_mutex_unlock(&(queue->mutex));
@@ -118,7 +123,16 @@ int pthread_queue_enqueue(pthread_queue_t * queue, void * value, uint32_t timeou
 
 int pthread_queue_dequeue(pthread_queue_t * queue, void * buf, uint32_t timeout) {
 
+	return pthread_queue_dequeue_many(queue, buf, 1, timeout) == 1 ? PTHREAD_QUEUE_OK : PTHREAD_QUEUE_EMPTY;
+
+}
+
+int pthread_queue_dequeue_many(pthread_queue_t * queue, void * buf, int count, uint32_t timeout) {
+
 	int ret;
+
+	if (count < 1)
+		return 0;
 	
 	/* Calculate timeout */
 	struct timespec ts;
@@ -138,23 +152,30 @@ int pthread_queue_dequeue(pthread_queue_t * queue, void * buf, uint32_t timeout)
 	/* Get queue lock */
 	pthread_mutex_lock(&(queue->mutex));
 	while (queue->items == 0) {
+		if (timeout == 0) {
+			pthread_mutex_unlock(&(queue->mutex));
+			return 0;
+		}
 		ret = pthread_cond_timedwait(&(queue->cond_empty), &(queue->mutex), &ts);
 		if (ret != 0) {
 			pthread_mutex_unlock(&(queue->mutex));
-			return PTHREAD_QUEUE_EMPTY;
+			return 0;
 		}
 	}
 
-	/* Coby object to output buffer */
-	memcpy(buf, queue->buffer+(queue->out * queue->item_size), queue->item_size);
-	queue->items--;
-	queue->out = (queue->out + 1) % queue->size;
+	/* Copy objects to output buffer, in two parts if they wrap around the end */
+	int items = queue->items < count ? queue->items : count;
+	int first = queue->size - queue->out < items ? queue->size - queue->out : items;
+	memcpy(buf, queue->buffer+(queue->out * queue->item_size), first * queue->item_size);
+	memcpy(buf+(first * queue->item_size), queue->buffer, (items - first) * queue->item_size);
+	queue->items -= items;
+	queue->out = (queue->out + items) % queue->size;
 	pthread_mutex_unlock(&(queue->mutex));
 	
 	/* Nofify blocked threads */
 	pthread_cond_broadcast(&(queue->cond_full));
 
-	return PTHREAD_QUEUE_OK;
+	return items;
 	
 }
 
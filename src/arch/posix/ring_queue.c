@@ -0,0 +1,268 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 Gomspace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+Bounded lock-free ring queue, based on the array queue by Dmitry Vyukov
+http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+Every slot carries a sequence number that tells whether it is ready to be
+written or read at a given position, so producers and consumers only contend
+on a single compare-and-swap of the tail and head positions. The mutex and
+condition variables are only used when a caller has to block on an empty or
+full queue, and the opposite side only takes the mutex if someone is waiting.
+*/
+
+#include <pthread.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+/* CSP includes */
+#include "ring_queue.h"
+
+ring_queue_t * ring_queue_create(int length, size_t item_size) {
+
+	int i;
+	pthread_condattr_t attr;
+
+	if (length < 1)
+		return NULL;
+
+	ring_queue_t * q = calloc(1, sizeof(ring_queue_t));
+	if (q == NULL)
+		return NULL;
+
+	q->seq = malloc(length * sizeof(*q->seq));
+	q->buffer = malloc(length * item_size);
+	if (q->seq == NULL || q->buffer == NULL)
+		goto err_free;
+
+	for (i = 0; i < length; i++)
+		q->seq[i] = i;
+	q->size = length;
+	q->item_size = item_size;
+
+	/* Timeouts are measured on the monotonic clock */
+	if (pthread_condattr_init(&attr))
+		goto err_free;
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if (pthread_mutex_init(&q->mutex, NULL) || pthread_cond_init(&q->cond_full, &attr) || pthread_cond_init(&q->cond_empty, &attr)) {
+		pthread_condattr_destroy(&attr);
+		goto err_free;
+	}
+	pthread_condattr_destroy(&attr);
+
+	return q;
+
+err_free:
+	free(q->buffer);
+	free(q->seq);
+	free(q);
+	return NULL;
+
+}
+
+void ring_queue_delete(ring_queue_t * q) {
+
+	if (q == NULL)
+		return;
+
+	pthread_cond_destroy(&q->cond_empty);
+	pthread_cond_destroy(&q->cond_full);
+	pthread_mutex_destroy(&q->mutex);
+	free(q->buffer);
+	free(q->seq);
+	free(q);
+
+}
+
+static int ring_queue_try_enqueue(ring_queue_t * q, void * value) {
+
+	uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	uint64_t * seq;
+
+	for (;;) {
+		seq = &q->seq[pos % q->size];
+		int64_t diff = (int64_t) (__atomic_load_n(seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Slot still holds an element from the previous lap */
+			return RING_QUEUE_FULL;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy((char *) q->buffer + (pos % q->size) * q->item_size, value, q->item_size);
+	__atomic_store_n(seq, pos + 1, __ATOMIC_RELEASE);
+
+	return RING_QUEUE_OK;
+
+}
+
+static int ring_queue_try_dequeue(ring_queue_t * q, void * buf) {
+
+	uint64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	uint64_t * seq;
+
+	for (;;) {
+		seq = &q->seq[pos % q->size];
+		int64_t diff = (int64_t) (__atomic_load_n(seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Slot has not been written in this lap yet */
+			return RING_QUEUE_EMPTY;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(buf, (char *) q->buffer + (pos % q->size) * q->item_size, q->item_size);
+	__atomic_store_n(seq, pos + q->size, __ATOMIC_RELEASE);
+
+	return RING_QUEUE_OK;
+
+}
+
+/* Wake threads blocked on the other side of the queue, if there are any.
+ * One is enough for a single element, all may proceed after several */
+static void ring_queue_wake(ring_queue_t * q, int * waiters, pthread_cond_t * cond, int all) {
+
+	/* Orders the slot update before the waiter check. Pairs with the
+	 * increment in ring_queue_wait, so either the waiter sees the slot or
+	 * we see the waiter */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0)
+		return;
+
+	pthread_mutex_lock(&q->mutex);
+	if (all)
+		pthread_cond_broadcast(cond);
+	else
+		pthread_cond_signal(cond);
+	pthread_mutex_unlock(&q->mutex);
+
+}
+
+/* Block until try() succeeds or the timeout expires */
+static int ring_queue_wait(ring_queue_t * q, int (*try)(ring_queue_t *, void *), void * item,
+		int * waiters, pthread_cond_t * cond, uint32_t timeout) {
+
+	int ret;
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return RING_QUEUE_ERROR;
+
+	uint32_t sec = timeout / 1000;
+	uint32_t nsec = (timeout - 1000 * sec) * 1000000;
+
+	ts.tv_sec += sec;
+
+	if (ts.tv_nsec + nsec >= 1000000000)
+		ts.tv_sec++;
+
+	ts.tv_nsec = (ts.tv_nsec + nsec) % 1000000000;
+
+	pthread_mutex_lock(&q->mutex);
+	__atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+
+	while ((ret = try(q, item)) != RING_QUEUE_OK) {
+		if (timeout == CSP_MAX_DELAY) {
+			pthread_cond_wait(cond, &q->mutex);
+		} else if (pthread_cond_timedwait(cond, &q->mutex, &ts) == ETIMEDOUT) {
+			ret = try(q, item);
+			break;
+		}
+	}
+
+	__atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&q->mutex);
+
+	return ret;
+
+}
+
+int ring_queue_enqueue(ring_queue_t * queue, void * value, uint32_t timeout) {
+
+	int ret = ring_queue_try_enqueue(queue, value);
+	if (ret != RING_QUEUE_OK && timeout > 0)
+		ret = ring_queue_wait(queue, ring_queue_try_enqueue, value, &queue->waiters_full, &queue->cond_full, timeout);
+
+	if (ret == RING_QUEUE_OK)
+		ring_queue_wake(queue, &queue->waiters_empty, &queue->cond_empty, 0);
+
+	return ret;
+
+}
+
+int ring_queue_dequeue(ring_queue_t * queue, void * buf, uint32_t timeout) {
+
+	int ret = ring_queue_try_dequeue(queue, buf);
+	if (ret != RING_QUEUE_OK && timeout > 0)
+		ret = ring_queue_wait(queue, ring_queue_try_dequeue, buf, &queue->waiters_empty, &queue->cond_empty, timeout);
+
+	if (ret == RING_QUEUE_OK)
+		ring_queue_wake(queue, &queue->waiters_full, &queue->cond_full, 0);
+
+	return ret;
+
+}
+
+int ring_queue_dequeue_many(ring_queue_t * queue, void * buf, int count, uint32_t timeout) {
+
+	int found;
+
+	if (count < 1 || ring_queue_dequeue(queue, buf, timeout) != RING_QUEUE_OK)
+		return 0;
+
+	/* Take the elements that are already there. ring_queue_dequeue has woken
+	 * one writer for the first, wake all for the rest, as each may proceed */
+	for (found = 1; found < count; found++)
+		if (ring_queue_try_dequeue(queue, (char *) buf + found * queue->item_size) != RING_QUEUE_OK)
+			break;
+
+	if (found > 1)
+		ring_queue_wake(queue, &queue->waiters_full, &queue->cond_full, 1);
+
+	return found;
+
+}
+
+int ring_queue_items(ring_queue_t * queue) {
+
+	uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+	/* The two positions are read separately, so clamp the difference */
+	if (tail <= head)
+		return 0;
+	if (tail - head > (uint64_t) queue->size)
+		return queue->size;
+
+	return tail - head;
+
+}
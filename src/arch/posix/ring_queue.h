@@ -0,0 +1,71 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 Gomspace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk) 
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+Bounded lock-free ring queue, based on the array queue by Dmitry Vyukov
+http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+*/
+
+#ifndef _RING_QUEUE_H_
+#define _RING_QUEUE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <csp/arch/csp_queue.h>
+
+#define RING_QUEUE_ERROR CSP_QUEUE_ERROR
+#define RING_QUEUE_EMPTY CSP_QUEUE_ERROR
+#define RING_QUEUE_FULL CSP_QUEUE_ERROR
+#define RING_QUEUE_OK CSP_QUEUE_OK
+
+typedef struct ring_queue_s {
+	uint64_t head;				// Next position to dequeue
+	char pad_head[56];			// Keep producers and consumers on separate cache lines
+	uint64_t tail;				// Next position to enqueue
+	char pad_tail[56];
+	uint64_t * seq;				// Sequence number of each slot
+	void * buffer;
+	int size;
+	int item_size;
+	int waiters_empty;			// Threads blocked in dequeue
+	int waiters_full;			// Threads blocked in enqueue
+	pthread_mutex_t mutex;		// Only taken when blocking or waking
+	pthread_cond_t cond_full;
+	pthread_cond_t cond_empty;
+} ring_queue_t;
+
+ring_queue_t * ring_queue_create(int length, size_t item_size);
+void ring_queue_delete(ring_queue_t * q);
+int ring_queue_enqueue(ring_queue_t * queue, void * value, uint32_t timeout);
+int ring_queue_dequeue(ring_queue_t * queue, void * buf, uint32_t timeout);
+int ring_queue_dequeue_many(ring_queue_t * queue, void * buf, int count, uint32_t timeout);
+int ring_queue_items(ring_queue_t * queue);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _RING_QUEUE_H_
@@ -25,6 +25,17 @@ int csp_queue_dequeue(csp_queue_handle_t handle, void *buf, uint32_t timeout) {
 	return windows_queue_dequeue(handle, buf, timeout);
 }
 
+int csp_queue_dequeue_many(csp_queue_handle_t handle, void *buf, int count, uint32_t timeout) {
+	windows_queue_t * queue = handle;
+	int found;
+	if( count < 1 || windows_queue_dequeue(queue, buf, timeout) != WINDOWS_QUEUE_OK )
+		return 0;
+	for(found = 1; found < count; found++)
+		if( windows_queue_dequeue(queue, (unsigned char*)buf + found * queue->item_size, 0) != WINDOWS_QUEUE_OK )
+			break;
+	return found;
+}
+
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE * task_woken) {
 	if( task_woken != NULL )
 		*task_woken = 0;
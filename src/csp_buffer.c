@@ -29,151 +29,459 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/arch/csp_malloc.h>
 #include <csp/arch/csp_semaphore.h>
 
-static csp_queue_handle_t csp_buffers;
-static int* csp_buffer_counts;
-static void *csp_buffer_list;
-static unsigned int count, size;
+#ifdef CSP_USE_BUFFER_CACHE
+#include <pthread.h>
+#endif
+
+/**
+ * Room reserved behind the requested size when picking a size class, for the
+ * trailers appended on the way out: RDP header (5), RDP receive window (2),
+ * HMAC (4), CRC32 (4) and XTEA nonce (4). The largest class is used without
+ * this margin, as before.
+ */
+#define CSP_BUFFER_TAILROOM		19
+
+/** One fixed element size pool */
+typedef struct {
+	csp_queue_handle_t queue;
+	int * counts;
+	void * list;
+	unsigned int count, size;
+} csp_buffer_pool_t;
+
+/* Pools sorted by ascending element size */
+static csp_buffer_pool_t pools[CSP_BUFFER_CLASSES_MAX];
+static unsigned int pool_count;
 
 CSP_DEFINE_CRITICAL(csp_critical_lock);
 
-int csp_buffer_init(int buf_count, int buf_size) {
+#ifdef CSP_USE_BUFFER_CACHE
+
+/* Number of buffers moved between a thread cache and the pool at a time */
+#define CSP_BUFFER_CACHE_BATCH	((CSP_BUFFER_CACHE_SIZE + 1) / 2)
+
+/** Per-thread LIFO of free buffers (magazine) in front of each pool queue */
+typedef struct {
+	unsigned int items[CSP_BUFFER_CLASSES_MAX];
+	void * element[CSP_BUFFER_CLASSES_MAX][CSP_BUFFER_CACHE_SIZE];
+} csp_buffer_cache_t;
+
+static __thread csp_buffer_cache_t * csp_buffer_cache;
+static pthread_key_t csp_buffer_cache_key;
+
+/* Free buffers currently parked in thread caches */
+static int csp_buffer_cached;
+
+static void csp_buffer_cache_drain(csp_buffer_cache_t * cache, unsigned int class, unsigned int items) {
+
+	while (items-- > 0 && cache->items[class] > 0) {
+		csp_queue_enqueue(pools[class].queue, &cache->element[class][--cache->items[class]], 0);
+		__sync_fetch_and_sub(&csp_buffer_cached, 1);
+	}
+
+}
+
+/* Return the cached buffers of a terminating thread to the pool */
+static void csp_buffer_cache_destroy(void * arg) {
+
+	csp_buffer_cache_t * cache = arg;
+	unsigned int class;
+
+	for (class = 0; class < pool_count; class++)
+		csp_buffer_cache_drain(cache, class, cache->items[class]);
+	csp_free(cache);
+
+}
+
+static csp_buffer_cache_t * csp_buffer_cache_get(void) {
+
+	if (csp_buffer_cache == NULL) {
+		csp_buffer_cache = csp_malloc(sizeof(csp_buffer_cache_t));
+		if (csp_buffer_cache == NULL)
+			return NULL;
+		memset(csp_buffer_cache->items, 0, sizeof(csp_buffer_cache->items));
+		pthread_setspecific(csp_buffer_cache_key, csp_buffer_cache);
+	}
+
+	return csp_buffer_cache;
+
+}
+
+#endif
+
+/* Take a free element from a pool, through the thread cache if enabled */
+static void *csp_buffer_pool_get(unsigned int class) {
+
+	void *buffer = NULL;
+
+#ifdef CSP_USE_BUFFER_CACHE
+	csp_buffer_cache_t * cache = csp_buffer_cache_get();
+	if (cache != NULL) {
+		unsigned int * items = &cache->items[class];
+		/* Refill an empty magazine with a batch from the pool */
+		if (*items == 0) {
+			while (*items < CSP_BUFFER_CACHE_BATCH &&
+					csp_queue_dequeue(pools[class].queue, &cache->element[class][*items], 0) == CSP_QUEUE_OK) {
+				(*items)++;
+				__sync_fetch_and_add(&csp_buffer_cached, 1);
+			}
+		}
+		if (*items > 0) {
+			__sync_fetch_and_sub(&csp_buffer_cached, 1);
+			return cache->element[class][--(*items)];
+		}
+		return NULL;
+	}
+#endif
+
+	csp_queue_dequeue(pools[class].queue, &buffer, 0);
+	return buffer;
+
+}
+
+/* Return an element, whose last reference was dropped, to its pool */
+static void csp_buffer_pool_put(unsigned int class, void *buffer) {
+
+#ifdef CSP_USE_BUFFER_CACHE
+	csp_buffer_cache_t * cache = csp_buffer_cache_get();
+	if (cache != NULL) {
+		/* Spill half of a full magazine back to the pool */
+		if (cache->items[class] == CSP_BUFFER_CACHE_SIZE)
+			csp_buffer_cache_drain(cache, class, CSP_BUFFER_CACHE_BATCH);
+		cache->element[class][cache->items[class]++] = buffer;
+		__sync_fetch_and_add(&csp_buffer_cached, 1);
+		return;
+	}
+#endif
+
+	csp_queue_enqueue(pools[class].queue, &buffer, 0);
+
+}
+
+static int csp_buffer_pool_init(csp_buffer_pool_t * pool, unsigned int count, unsigned int size) {
 
 	unsigned int i;
 	void *element;
 
-	count = buf_count;
-	size = buf_size;
+	pool->count = count;
+	pool->size = size;
 
-	csp_buffer_list = csp_malloc(count * size);
-	if (csp_buffer_list == NULL)
+	pool->list = csp_malloc(count * size);
+	if (pool->list == NULL)
 		goto fail_malloc;
 
-	csp_buffer_counts = csp_malloc(count * sizeof(int));
-	if (csp_buffer_counts == NULL)
+	pool->counts = csp_malloc(count * sizeof(int));
+	if (pool->counts == NULL)
 		goto fail_counts;
 
-	csp_buffers = csp_queue_create(count, sizeof(void *));
-	if (!csp_buffers)
+	pool->queue = csp_queue_create(count, sizeof(void *));
+	if (!pool->queue)
 		goto fail_queue;
 
-	if (CSP_INIT_CRITICAL(csp_critical_lock) != CSP_ERR_NONE)
-		goto fail_critical;
-
-	memset(csp_buffer_list, 0, count * size);
+	memset(pool->list, 0, count * size);
 
 	for (i = 0; i < count; i++) {
-		element = csp_buffer_list + i * size;
-		csp_buffer_counts[i] = 0;
-		csp_queue_enqueue(csp_buffers, &element, 0);
+		element = pool->list + i * size;
+		pool->counts[i] = 0;
+		csp_queue_enqueue(pool->queue, &element, 0);
 	}
 
 	return CSP_ERR_NONE;
 
-fail_critical:
-	csp_queue_remove(csp_buffers);
 fail_queue:
-	csp_free(csp_buffer_counts);
+	csp_free(pool->counts);
 fail_counts:
-	csp_free(csp_buffer_list);
+	csp_free(pool->list);
 fail_malloc:
 	return CSP_ERR_NOMEM;
 
 }
 
-static int csp_buffer_index(void *packet) {
+static void csp_buffer_pool_remove(csp_buffer_pool_t * pool) {
+	csp_queue_remove(pool->queue);
+	csp_free(pool->counts);
+	csp_free(pool->list);
+}
+
+int csp_buffer_init_classes(const csp_buffer_class_t * classes, int class_count) {
+
+	int i, j;
+	csp_buffer_class_t sorted[CSP_BUFFER_CLASSES_MAX];
+
+	if (classes == NULL || class_count < 1 || class_count > CSP_BUFFER_CLASSES_MAX)
+		return CSP_ERR_INVAL;
+
+	/* Sort classes by element size, so lookups can stop at the first fit */
+	for (i = 0; i < class_count; i++) {
+		if (classes[i].count < 1 || classes[i].size < (int) CSP_BUFFER_PACKET_OVERHEAD)
+			return CSP_ERR_INVAL;
+		for (j = i; j > 0 && sorted[j - 1].size > classes[i].size; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = classes[i];
+	}
+
+	for (pool_count = 0; pool_count < (unsigned int) class_count; pool_count++)
+		if (csp_buffer_pool_init(&pools[pool_count], sorted[pool_count].count, sorted[pool_count].size) != CSP_ERR_NONE)
+			goto fail_pool;
+
+	if (CSP_INIT_CRITICAL(csp_critical_lock) != CSP_ERR_NONE)
+		goto fail_pool;
+
+#ifdef CSP_USE_BUFFER_CACHE
+	if (pthread_key_create(&csp_buffer_cache_key, csp_buffer_cache_destroy) != 0)
+		goto fail_pool;
+#endif
+
+	return CSP_ERR_NONE;
+
+fail_pool:
+	while (pool_count > 0)
+		csp_buffer_pool_remove(&pools[--pool_count]);
+	return CSP_ERR_NOMEM;
+
+}
+
+int csp_buffer_init(int buf_count, int buf_size) {
+
+	csp_buffer_class_t class = {
+		.count = buf_count,
+		.size = buf_size,
+	};
+
+	return csp_buffer_init_classes(&class, 1);
+
+}
+
+/* Find the element index of a buffer within a pool */
+static int csp_buffer_pool_index(csp_buffer_pool_t * pool, void *packet) {
+
+	uintptr_t offset;
+
+	/* Buffers are laid out back to back, so the index follows from the offset */
+	if ((uintptr_t) packet < (uintptr_t) pool->list)
+		return -1;
+
+	offset = (uintptr_t) packet - (uintptr_t) pool->list;
+	if (offset >= (uintptr_t) pool->count * pool->size)
+		return -1;
+
+	/* Reject pointers into the middle of an element */
+	if (offset % pool->size != 0)
+		return -1;
+
+	return offset / pool->size;
+
+}
+
+/* Find the pool and element index of a buffer */
+static int csp_buffer_index(void *packet, unsigned int * class) {
+
+	int index;
+
 	if (!packet)
 		return -1;
 
-	for (int i = 0; i < count; i++) {
-		if (csp_buffer_list + i * size == packet) {
-			return i;
-		}
+	for (*class = 0; *class < pool_count; (*class)++) {
+		index = csp_buffer_pool_index(&pools[*class], packet);
+		if (index >= 0)
+			return index;
 	}
+
 	return -1;
+
+}
+
+/* Return the first class that fits buf_size, or -1 if no class does */
+static int csp_buffer_class(size_t buf_size) {
+
+	unsigned int class;
+
+	if (pool_count == 0 || buf_size + CSP_BUFFER_PACKET_OVERHEAD > pools[pool_count - 1].size)
+		return -1;
+
+	for (class = 0; class < pool_count - 1; class++)
+		if (buf_size + CSP_BUFFER_PACKET_OVERHEAD + CSP_BUFFER_TAILROOM <= pools[class].size)
+			break;
+
+	return class;
+
 }
 
 void *csp_buffer_get_isr(size_t buf_size) {
-	int index = -1;
 	void *buffer = NULL;
 	CSP_BASE_TYPE task_woken = 0;
 
-	if (buf_size + CSP_BUFFER_PACKET_OVERHEAD > size)
+	if (csp_buffer_class(buf_size) < 0)
 		return NULL;
 
-	csp_queue_dequeue_isr(csp_buffers, &buffer, &task_woken);
-	index = csp_buffer_index(buffer);
-	if (index >= 0 && index < (int) count) {
-		csp_buffer_counts[index]++;
-		return buffer;
+	/* Packets received in ISR are handed to the application, so use full size */
+	csp_buffer_pool_t * pool = &pools[pool_count - 1];
+	csp_queue_dequeue_isr(pool->queue, &buffer, &task_woken);
+	if (buffer != NULL)
+		pool->counts[csp_buffer_pool_index(pool, buffer)]++;
+
+	return buffer;
+}
+
+/* Get a buffer from class, or from a larger class if it is exhausted */
+static void *csp_buffer_get_class(int class) {
+	void *buffer = NULL;
+
+	for (; class < (int) pool_count; class++) {
+		buffer = csp_buffer_pool_get(class);
+		if (buffer != NULL) {
+			pools[class].counts[csp_buffer_pool_index(&pools[class], buffer)]++;
+			break;
+		}
+	}
+
+	if (buffer != NULL) {
+		csp_log_buffer("BUFFER: Using element at %p\r\n", buffer);
+	} else {
+		csp_log_error("Out of buffers\r\n");
 	}
 
-	return NULL;
+	return buffer;
 }
 
 void *csp_buffer_get(size_t buf_size) {
-	void *buffer = NULL;
-	int index = -1;
 
-	if (buf_size + CSP_BUFFER_PACKET_OVERHEAD > size) {
+	if (csp_buffer_class(buf_size) < 0) {
 		csp_log_error("Attempt to allocate too large block %u\r\n", buf_size);
 		return NULL;
 	}
 
-	csp_queue_dequeue(csp_buffers, &buffer, 0);
-	index = csp_buffer_index(buffer);
+	/* Always full size, as a packet may be reused for a larger reply */
+	return csp_buffer_get_class(pool_count - 1);
+
+}
+
+void *csp_buffer_get_small(size_t buf_size) {
+
+	int class = csp_buffer_class(buf_size);
+	if (class < 0) {
+		csp_log_error("Attempt to allocate too large block %u\r\n", buf_size);
+		return NULL;
+	}
+
+	return csp_buffer_get_class(class);
+
+}
+
+void *csp_buffer_get_small_timeout(size_t buf_size, uint32_t timeout) {
 
-	if (index >= 0 && index < (int) count) {
-		csp_buffer_counts[index]++;
+	int class = csp_buffer_class(buf_size);
+	if (class < 0) {
+		csp_log_error("Attempt to allocate too large block %u\r\n", buf_size);
+		return NULL;
 	}
 
+	/* Any class that fits will do, before waiting */
+	void *buffer = NULL;
+	int found;
+	for (found = class; found < (int) pool_count && buffer == NULL; found++)
+		buffer = csp_buffer_pool_get(found);
+
+	/* Wait on the best fit pool itself, so the first buffer freed is handed over */
 	if (buffer != NULL) {
-		csp_log_buffer("BUFFER: Using element at %p\r\n", buffer);
-	} else {
+		class = found - 1;
+	} else if (timeout == 0 || csp_queue_dequeue(pools[class].queue, &buffer, timeout) != CSP_QUEUE_OK) {
 		csp_log_error("Out of buffers\r\n");
+		return NULL;
 	}
 
+	pools[class].counts[csp_buffer_pool_index(&pools[class], buffer)]++;
+	csp_log_buffer("BUFFER: Using element at %p\r\n", buffer);
 	return buffer;
+
 }
 
 
 void csp_buffer_free_isr(void *packet) {
 	CSP_BASE_TYPE task_woken = 0;
+	CSP_BASE_TYPE state = 0;
+	unsigned int class;
 	if (!packet)
 		return;
 
-	int index = csp_buffer_index(packet);
-	if (index < 0 || index >= (int) count) {
+	int index = csp_buffer_index(packet, &class);
+	if (index < 0) {
 		return;
 	}
 
-	csp_buffer_counts[index]--;
-	if (csp_buffer_counts[index] == 0) {
-		csp_queue_enqueue_isr(csp_buffers, &packet, &task_woken);
-	}
+	/* Same reference counting as csp_buffer_free, the thread caches are bypassed */
+	CSP_ENTER_CRITICAL_ISR(csp_critical_lock, state);
+	int count = pools[class].counts[index];
+	if (count > 0)
+		pools[class].counts[index] = count - 1;
+	CSP_EXIT_CRITICAL_ISR(csp_critical_lock, state);
+
+	if (count == 1)
+		csp_queue_enqueue_isr(pools[class].queue, &packet, &task_woken);
 }
 
 void csp_buffer_free(void *packet) {
+	unsigned int class;
+
 	if (!packet) {
 		csp_log_error("Attempt to free null pointer\r\n");
 		return;
 	}
 
-	int index = csp_buffer_index(packet);
-	if (index < 0 || index >= (int) count) {
+	int index = csp_buffer_index(packet, &class);
+	if (index < 0) {
 		csp_log_error("Couldn't find buffer: %p\r\n", packet);
 		return;
 	}
 
-	csp_buffer_counts[index]--;
-	if (csp_buffer_counts[index] == 0) {
+	/* Drop one reference, the buffer is returned when the last one is gone */
+	CSP_ENTER_CRITICAL(csp_critical_lock);
+	int count = pools[class].counts[index];
+	if (count > 0)
+		pools[class].counts[index] = count - 1;
+	CSP_EXIT_CRITICAL(csp_critical_lock);
+
+	if (count == 1) {
 		csp_log_buffer("BUFFER: Free element at %p\r\n", packet);
-		csp_queue_enqueue(csp_buffers, &packet, 0);
-	} else {
+		csp_buffer_pool_put(class, packet);
+	} else if (count <= 0) {
 		csp_log_warn("BUFFER: Ignoring double-freed buffer %p\r\n", packet);
-		csp_buffer_counts[index] = 0;
 	}
 }
 
+void *csp_buffer_ref(void *packet) {
+	unsigned int class;
+
+	int index = csp_buffer_index(packet, &class);
+	if (index < 0) {
+		csp_log_error("Couldn't find buffer: %p\r\n", packet);
+		return NULL;
+	}
+
+	CSP_ENTER_CRITICAL(csp_critical_lock);
+	int count = pools[class].counts[index];
+	if (count > 0)
+		pools[class].counts[index]++;
+	CSP_EXIT_CRITICAL(csp_critical_lock);
+
+	if (count <= 0) {
+		csp_log_warn("BUFFER: Attempt to reference free buffer %p\r\n", packet);
+		return NULL;
+	}
+
+	return packet;
+}
+
+int csp_buffer_refcount(void *packet) {
+	unsigned int class;
+
+	int index = csp_buffer_index(packet, &class);
+	if (index < 0)
+		return 0;
+
+	return pools[class].counts[index];
+}
+
 void *csp_buffer_clone(void *buffer) {
 
 	csp_packet_t *packet = (csp_packet_t *) buffer;
@@ -181,19 +489,41 @@ void *csp_buffer_clone(void *buffer) {
 	if (!packet)
 		return NULL;
 
-	csp_packet_t *clone = csp_buffer_get(packet->length);
+	csp_packet_t *clone = csp_buffer_get_small(packet->length);
 
+	/* Only the header and the used part of the data are copied */
 	if (clone)
-		memcpy(clone, packet, size);
+		memcpy(clone, packet, CSP_BUFFER_PACKET_OVERHEAD + packet->length);
 
 	return clone;
 
 }
 
 int csp_buffer_remaining(void) {
-	return csp_queue_size(csp_buffers);
+
+	unsigned int class;
+	int remaining = 0;
+
+	for (class = 0; class < pool_count; class++)
+		remaining += csp_queue_size(pools[class].queue);
+
+#ifdef CSP_USE_BUFFER_CACHE
+	remaining += csp_buffer_cached;
+#endif
+
+	return remaining;
+
+}
+
+int csp_buffer_element_size(void *packet) {
+	unsigned int class;
+
+	if (csp_buffer_index(packet, &class) < 0)
+		return 0;
+
+	return pools[class].size;
 }
 
 int csp_buffer_size(void) {
-	return size;
+	return pool_count > 0 ? (int) pools[pool_count - 1].size : 0;
 }
@@ -33,7 +33,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/arch/csp_malloc.h>
 #include <csp/arch/csp_time.h>
 
+#ifdef CSP_USE_EVENTFD
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+
 #include "csp/csp_conn.h"
+#include "csp_route.h"
 #include "transport/csp_transport.h"
 
 /* Static connection pool */
@@ -42,20 +48,194 @@ csp_conn_t arr_conn[CSP_CONN_MAX];
 /* Connection pool lock */
 static csp_bin_sem_handle_t conn_lock;
 
+/* Protects the poll semaphore of all connections and sockets */
+static csp_mutex_t poll_lock;
+
+/* Below this many connections the unlocked linear scan beats the hash table
+ * and its bucket locks, so small builds leave the hash table out */
+#ifndef CSP_CONN_HASH_MIN
+#define CSP_CONN_HASH_MIN 32
+#endif
+
+#if CSP_CONN_MAX >= CSP_CONN_HASH_MIN
+#define CSP_CONN_HASH
+#endif
+
+#ifdef CSP_CONN_HASH
+/* Open client connections, hashed on idin & CSP_ID_CONN_MASK. Each bucket has
+ * its own lock, so router workers looking up different connections do not wait
+ * for each other or for conn_lock */
+#define CSP_CONN_HASH_SIZE CSP_CONN_MAX
+static csp_conn_t * conn_hash[CSP_CONN_HASH_SIZE];
+static csp_mutex_t conn_hash_lock[CSP_CONN_HASH_SIZE];
+#endif
+
+/* Closed connections, in the order they were closed */
+static csp_conn_t * conn_free_head;
+static csp_conn_t * conn_free_tail;
+
+/* Per router worker min-heap of connection deadlines */
+typedef struct {
+	csp_mutex_t lock;
+	int count;
+	csp_conn_t * conn[CSP_CONN_MAX];
+} csp_conn_timers_t;
+
+static csp_conn_timers_t conn_timers[CSP_ROUTER_WORKERS];
+
 /* Source port */
 static uint8_t sport;
 
 /* Source port lock */
 static csp_bin_sem_handle_t sport_lock;
 
-void csp_conn_check_timeouts(void) {
-#ifdef CSP_USE_RDP
+/* Return 1 if deadline a is before deadline b */
+static inline int csp_conn_deadline_before(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) < 0;
+}
+
+static inline void csp_conn_timer_set(csp_conn_timers_t * timers, int pos, csp_conn_t * conn) {
+	timers->conn[pos] = conn;
+	conn->timer = pos;
+}
+
+/* Move the entry at pos towards the root until the heap is ordered */
+static void csp_conn_timer_up(csp_conn_timers_t * timers, int pos) {
+
+	csp_conn_t * conn = timers->conn[pos];
+
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (!csp_conn_deadline_before(conn->deadline, timers->conn[parent]->deadline))
+			break;
+		csp_conn_timer_set(timers, pos, timers->conn[parent]);
+		pos = parent;
+	}
+
+	csp_conn_timer_set(timers, pos, conn);
+
+}
+
+/* Move the entry at pos towards the leaves until the heap is ordered */
+static void csp_conn_timer_down(csp_conn_timers_t * timers, int pos) {
+
+	csp_conn_t * conn = timers->conn[pos];
+
+	while (1) {
+		int child = 2 * pos + 1;
+		if (child >= timers->count)
+			break;
+		if (child + 1 < timers->count && csp_conn_deadline_before(timers->conn[child + 1]->deadline, timers->conn[child]->deadline))
+			child++;
+		if (!csp_conn_deadline_before(timers->conn[child]->deadline, conn->deadline))
+			break;
+		csp_conn_timer_set(timers, pos, timers->conn[child]);
+		pos = child;
+	}
+
+	csp_conn_timer_set(timers, pos, conn);
+
+}
+
+/* Must be called with the heap lock held */
+static void csp_conn_timer_remove(csp_conn_timers_t * timers, csp_conn_t * conn) {
+
+	int pos = conn->timer;
+	conn->timer = -1;
+
+	if (--timers->count == pos)
+		return;
+
+	/* Fill the hole with the last entry and restore the order */
+	csp_conn_t * last = timers->conn[timers->count];
+	csp_conn_timer_set(timers, pos, last);
+	csp_conn_timer_up(timers, pos);
+	csp_conn_timer_down(timers, last->timer);
+
+}
+
+void csp_conn_schedule(csp_conn_t * conn, uint32_t deadline) {
+
+	csp_conn_timers_t * timers = &conn_timers[csp_route_get_worker(conn->idin.ext)];
+
+	csp_mutex_lock(&timers->lock, CSP_MAX_DELAY);
+
+	/* A connection closed by another task must not end up in the heap again */
+	if (conn->state != CONN_OPEN) {
+		csp_mutex_unlock(&timers->lock);
+		return;
+	}
+
+	if (conn->timer < 0) {
+		conn->deadline = deadline;
+		timers->conn[timers->count] = conn;
+		csp_conn_timer_up(timers, timers->count++);
+	} else if (csp_conn_deadline_before(deadline, conn->deadline)) {
+		/* Only ever move a deadline forward, the check itself reschedules */
+		conn->deadline = deadline;
+		csp_conn_timer_up(timers, conn->timer);
+	}
+
+	csp_mutex_unlock(&timers->lock);
+
+}
+
+void csp_conn_unschedule(csp_conn_t * conn) {
+
+	csp_conn_timers_t * timers = &conn_timers[csp_route_get_worker(conn->idin.ext)];
+
+	csp_mutex_lock(&timers->lock, CSP_MAX_DELAY);
+	if (conn->timer >= 0)
+		csp_conn_timer_remove(timers, conn);
+	csp_mutex_unlock(&timers->lock);
+
+}
+
+uint32_t csp_conn_next_timeout(int worker, uint32_t max) {
+
+	csp_conn_timers_t * timers = &conn_timers[worker];
+	uint32_t timeout = max;
+
+	csp_mutex_lock(&timers->lock, CSP_MAX_DELAY);
+	if (timers->count > 0) {
+		int32_t remaining = timers->conn[0]->deadline - csp_get_ms();
+		if (remaining <= 0)
+			timeout = 0;
+		else if ((uint32_t) remaining < max)
+			timeout = remaining;
+	}
+	csp_mutex_unlock(&timers->lock);
+
+	return timeout;
+
+}
+
+void csp_conn_check_timeouts(int worker) {
+
+	csp_conn_timers_t * timers = &conn_timers[worker];
+	csp_conn_t * conn;
 	int i;
-	for (i = 0; i < CSP_CONN_MAX; i++)
-		if (arr_conn[i].state == CONN_OPEN)
-			if (arr_conn[i].idin.flags & CSP_FRDP)
-				csp_rdp_check_timeouts(&arr_conn[i]);
+
+	/* Each connection is checked at most once per call, even if the check
+	 * schedules a deadline that has already passed */
+	for (i = 0; i < CSP_CONN_MAX; i++) {
+
+		csp_mutex_lock(&timers->lock, CSP_MAX_DELAY);
+		conn = timers->count > 0 ? timers->conn[0] : NULL;
+		if (conn == NULL || csp_conn_deadline_before(csp_get_ms(), conn->deadline)) {
+			csp_mutex_unlock(&timers->lock);
+			break;
+		}
+		csp_conn_timer_remove(timers, conn);
+		csp_mutex_unlock(&timers->lock);
+
+#ifdef CSP_USE_RDP
+		if (conn->state == CONN_OPEN && (conn->idin.flags & CSP_FRDP))
+			csp_rdp_check_timeouts(conn);
 #endif
+
+	}
+
 }
 
 int csp_conn_get_rxq(int prio) {
@@ -106,9 +286,159 @@ int csp_conn_enqueue_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		return CSP_ERR_NOMEM;
 #endif
 
+	csp_conn_notify(conn);
+
 	return CSP_ERR_NONE;
 }
 
+void csp_conn_notify(csp_conn_t * conn) {
+
+	if (conn == NULL)
+		return;
+
+#ifdef CSP_USE_EVENTFD
+	/* Only write on the transition from empty, the eventfd stays readable until cleared */
+	uint64_t one = 1;
+	if (__sync_val_compare_and_swap(&conn->signalled, 0, 1) == 0)
+		if (write(conn->eventfd, &one, sizeof(one)) != sizeof(one))
+			csp_log_warn("Failed to signal connection eventfd\r\n");
+#endif
+
+	/* Only take the lock when a task polls. The barrier pairs with the one in
+	 * csp_conn_poll_add: either the poller sees the new packet when it checks
+	 * again, or this sees its semaphore */
+	__sync_synchronize();
+	if (conn->poll == NULL)
+		return;
+
+	/* The lock keeps the semaphore alive until it has been posted */
+	csp_mutex_lock(&poll_lock, CSP_MAX_DELAY);
+	if (conn->poll != NULL)
+		csp_bin_sem_post(conn->poll);
+	csp_mutex_unlock(&poll_lock);
+
+}
+
+int csp_conn_poll_add(csp_conn_t * conn, csp_bin_sem_handle_t * sem) {
+
+	int ret = CSP_ERR_NONE;
+
+	/* Only one task can poll a connection, a second one would never be woken */
+	csp_mutex_lock(&poll_lock, CSP_MAX_DELAY);
+	if (conn->poll != NULL && conn->poll != sem)
+		ret = CSP_ERR_BUSY;
+	else
+		conn->poll = sem;
+	__sync_synchronize();
+	csp_mutex_unlock(&poll_lock);
+
+	return ret;
+
+}
+
+void csp_conn_poll_remove(csp_conn_t * conn, csp_bin_sem_handle_t * sem) {
+
+	/* Another task may have started polling the connection since */
+	csp_mutex_lock(&poll_lock, CSP_MAX_DELAY);
+	if (conn->poll == sem)
+		conn->poll = NULL;
+	csp_mutex_unlock(&poll_lock);
+
+}
+
+#ifdef CSP_USE_EVENTFD
+/* Data is waiting in the queue, or in a partly read RDP stream segment */
+static int csp_conn_pending(csp_conn_t * conn, csp_queue_handle_t queue) {
+
+#ifdef CSP_USE_RDP
+	if (conn->rdp.rx_stream != NULL)
+		return 1;
+#endif
+	return csp_queue_size(queue) > 0;
+
+}
+#endif
+
+void csp_conn_rearm(csp_conn_t * conn, csp_queue_handle_t queue) {
+
+#ifdef CSP_USE_EVENTFD
+	/* The eventfd is only cleared once nothing is pending. A packet enqueued
+	 * before signalled is reset did not write it, so check again */
+	uint64_t count;
+	if (csp_conn_pending(conn, queue))
+		return;
+	if (read(conn->eventfd, &count, sizeof(count)) != sizeof(count))
+		return;
+	__sync_fetch_and_and(&conn->signalled, 0);
+	if (csp_conn_pending(conn, queue))
+		csp_conn_notify(conn);
+#endif
+
+}
+
+int csp_conn_fd(csp_conn_t * conn) {
+
+	if (conn == NULL)
+		return CSP_ERR_INVAL;
+
+#ifdef CSP_USE_EVENTFD
+	return conn->eventfd;
+#else
+	return CSP_ERR_NOTSUP;
+#endif
+
+}
+
+#ifdef CSP_CONN_HASH
+static inline unsigned int csp_conn_bucket(uint32_t id) {
+	return ((uint32_t) ((id & CSP_ID_CONN_MASK) * 2654435761U) >> 8) % CSP_CONN_HASH_SIZE;
+}
+
+static void csp_conn_hash_insert(csp_conn_t * conn) {
+
+	unsigned int bucket = csp_conn_bucket(conn->idin.ext);
+
+	csp_mutex_lock(&conn_hash_lock[bucket], CSP_MAX_DELAY);
+	conn->next = conn_hash[bucket];
+	conn_hash[bucket] = conn;
+	csp_mutex_unlock(&conn_hash_lock[bucket]);
+
+}
+
+/* Once this returns, no lookup can reach the connection, so next may be reused */
+static void csp_conn_hash_remove(csp_conn_t * conn) {
+
+	unsigned int bucket = csp_conn_bucket(conn->idin.ext);
+	csp_conn_t ** link = &conn_hash[bucket];
+
+	csp_mutex_lock(&conn_hash_lock[bucket], CSP_MAX_DELAY);
+	while (*link != NULL) {
+		if (*link == conn) {
+			*link = conn->next;
+			break;
+		}
+		link = &(*link)->next;
+	}
+	csp_mutex_unlock(&conn_hash_lock[bucket]);
+
+}
+#else
+static inline void csp_conn_hash_insert(csp_conn_t * conn) { }
+static inline void csp_conn_hash_remove(csp_conn_t * conn) { }
+#endif
+
+/* Must be called with conn_lock held */
+static void csp_conn_free_append(csp_conn_t * conn) {
+
+	conn->next = NULL;
+	if (conn_free_tail != NULL)
+		conn_free_tail->next = conn;
+	else
+		conn_free_head = conn;
+	conn_free_tail = conn;
+
+}
+
 int csp_conn_init(void) {
 
 	/* Initialize source port */
@@ -121,6 +451,22 @@ int csp_conn_init(void) {
 	}
 
 	int i, prio;
+#ifdef CSP_CONN_HASH
+	for (i = 0; i < CSP_CONN_HASH_SIZE; i++) {
+		if (csp_mutex_create(&conn_hash_lock[i]) != CSP_MUTEX_OK) {
+			csp_log_error("Failed to create hash lock\r\n");
+			return CSP_ERR_NOMEM;
+		}
+	}
+#endif
+
+	for (i = 0; i < CSP_ROUTER_WORKERS; i++) {
+		if (csp_mutex_create(&conn_timers[i].lock) != CSP_MUTEX_OK) {
+			csp_log_error("Failed to create timer lock\r\n");
+			return CSP_ERR_NOMEM;
+		}
+	}
+
 	for (i = 0; i < CSP_CONN_MAX; i++) {
 		for (prio = 0; prio < CSP_RX_QUEUES; prio++)
 			arr_conn[i].rx_queue[prio] = csp_queue_create(CSP_RX_QUEUE_LENGTH, sizeof(csp_packet_t *));
@@ -129,18 +475,29 @@ int csp_conn_init(void) {
 		arr_conn[i].rx_event = csp_queue_create(CSP_CONN_QUEUE_LENGTH, sizeof(int));
 #endif
 		arr_conn[i].state = CONN_CLOSED;
+		arr_conn[i].timer = -1;
 
 		if (csp_mutex_create(&arr_conn[i].lock) != CSP_MUTEX_OK) {
 			csp_log_error("Failed to create connection lock\r\n");
 			return CSP_ERR_NOMEM;
 		}
 
+#ifdef CSP_USE_EVENTFD
+		arr_conn[i].eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (arr_conn[i].eventfd < 0) {
+			csp_log_error("Failed to create connection eventfd\r\n");
+			return CSP_ERR_NOMEM;
+		}
+#endif
+
 #ifdef CSP_USE_RDP
 		if (csp_rdp_allocate(&arr_conn[i]) != CSP_ERR_NONE) {
 			csp_log_error("Failed to create queues for RDP in csp_conn_init\r\n");
 			return CSP_ERR_NOMEM;
 		}
 #endif
+
+		csp_conn_free_append(&arr_conn[i]);
 	}
 
 	if (csp_bin_sem_create(&conn_lock) != CSP_SEMAPHORE_OK) {
@@ -148,6 +505,16 @@ int csp_conn_init(void) {
 		return CSP_ERR_NOMEM;
 	}
 
+	if (csp_mutex_create(&poll_lock) != CSP_MUTEX_OK) {
+		csp_log_error("Failed to create poll lock\r\n");
+		return CSP_ERR_NOMEM;
+	}
+
+#ifdef CSP_USE_RDP
+	if (csp_rdp_quarantine_init() != CSP_ERR_NONE)
+		return CSP_ERR_NOMEM;
+#endif
+
 	return CSP_ERR_NONE;
 
 }
@@ -158,6 +525,19 @@ csp_conn_t * csp_conn_find(uint32_t id, uint32_t mask) {
 	int i;
 	csp_conn_t * conn;
 
+#ifdef CSP_CONN_HASH
+	/* Lookups on the full connection tuple go through the hash table */
+	if (mask == CSP_ID_CONN_MASK) {
+		unsigned int bucket = csp_conn_bucket(id);
+		csp_mutex_lock(&conn_hash_lock[bucket], CSP_MAX_DELAY);
+		for (conn = conn_hash[bucket]; conn != NULL; conn = conn->next)
+			if ((conn->idin.ext & mask) == (id & mask))
+				break;
+		csp_mutex_unlock(&conn_hash_lock[bucket]);
+		return conn;
+	}
+#endif
+
 	for (i = 0; i < CSP_CONN_MAX; i++) {
 		conn = &arr_conn[i];
 		if ((conn->state != CONN_CLOSED) && (conn->type == CONN_CLIENT) && (conn->idin.ext & mask) == (id & mask))
@@ -187,14 +567,19 @@ int csp_conn_flush_rx_queue(csp_conn_t * conn) {
 	while (csp_queue_dequeue(conn->rx_event, &event, 0) == CSP_QUEUE_OK);
 #endif
 
+#ifdef CSP_USE_EVENTFD
+	uint64_t count;
+	if (read(conn->eventfd, &count, sizeof(count)) < 0)
+		csp_log_protocol("Connection eventfd already clear\r\n");
+	conn->signalled = 0;
+#endif
+
 	return CSP_ERR_NONE;
 
 }
 
 csp_conn_t * csp_conn_allocate(csp_conn_type_t type) {
 
-	int i, j;
-	static uint8_t csp_conn_last_given = 0;
 	csp_conn_t * conn;
 
 	if (csp_bin_sem_wait(&conn_lock, 100) != CSP_SEMAPHORE_OK) {
@@ -202,27 +587,24 @@ csp_conn_t * csp_conn_allocate(csp_conn_type_t type) {
 		return NULL;
 	}
 
-	/* Search for free connection */
-	i = csp_conn_last_given;
-	i = (i + 1) % CSP_CONN_MAX;
-
-	for (j = 0; j < CSP_CONN_MAX; j++) {
-		conn = &arr_conn[i];
-		if (conn->state == CONN_CLOSED)
-			break;
-		i = (i + 1) % CSP_CONN_MAX;
-	}
-
-	if (conn->state == CONN_OPEN) {
+	/* Take the connection that has been closed for the longest time */
+	conn = conn_free_head;
+	if (conn == NULL) {
 		csp_log_error("No more free connections\r\n");
 		csp_bin_sem_post(&conn_lock);
 		return NULL;
 	}
 
+	conn_free_head = conn->next;
+	if (conn_free_head == NULL)
+		conn_free_tail = NULL;
+
+	conn->next = NULL;
 	conn->state = CONN_OPEN;
 	conn->socket = NULL;
+	conn->listener = NULL;
+	conn->poll = NULL;
 	conn->type = type;
-	csp_conn_last_given = i;
 	csp_bin_sem_post(&conn_lock);
 
 	return conn;
@@ -243,6 +625,9 @@ csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout) {
 
 		/* Ensure connection queue is empty */
 		csp_conn_flush_rx_queue(conn);
+
+		/* Make the connection visible to csp_conn_find */
+		csp_conn_hash_insert(conn);
 	}
 
 	return conn;
@@ -274,9 +659,24 @@ int csp_close(csp_conn_t * conn) {
 		return CSP_ERR_TIMEDOUT;
 	}
 
+	/* Another task may have closed the connection while we waited */
+	if (conn->state == CONN_CLOSED) {
+		csp_bin_sem_post(&conn_lock);
+		return CSP_ERR_NONE;
+	}
+
 	/* Set to closed */
 	conn->state = CONN_CLOSED;
 
+	/* Move connection from the hash table to the free list. The bucket lock is
+	 * taken inside conn_lock, never the other way around */
+	if (conn->type == CONN_CLIENT)
+		csp_conn_hash_remove(conn);
+	csp_conn_free_append(conn);
+
+	/* Cancel pending timeout check */
+	csp_conn_unschedule(conn);
+
 	/* Ensure connection queue is empty */
 	csp_conn_flush_rx_queue(conn);
 
@@ -366,6 +766,12 @@ csp_conn_t * csp_connect(uint8_t prio, uint8_t dest, uint8_t dport, uint32_t tim
 		/* Match on destination port of _incoming_ identifier */
 		conn = csp_conn_find(incoming_id.ext, CSP_ID_DPORT_MASK);
 
+#ifdef CSP_USE_RDP
+		/* Leave the ports of a recently closed connection alone */
+		if (conn == NULL && (incoming_id.flags & CSP_FRDP) && csp_rdp_quarantined(incoming_id.ext, NULL))
+			continue;
+#endif
+
 		/* Break if we found an unused ephemeral port */
 		if (conn == NULL)
 			break;
@@ -100,43 +100,52 @@ int csp_init(unsigned char address) {
 
 }
 
-csp_socket_t * csp_socket(uint32_t opts) {
-	
-	/* Validate socket options */
+int csp_socket_opts_check(uint32_t opts) {
+
 #ifndef CSP_USE_RDP
 	if (opts & CSP_SO_RDPREQ) {
 		csp_log_error("Attempt to create socket that requires RDP, but CSP was compiled without RDP support\r\n");
-		return NULL;
+		return CSP_ERR_NOTSUP;
 	}
 #endif
 
 #ifndef CSP_USE_XTEA
 	if (opts & CSP_SO_XTEAREQ) {
 		csp_log_error("Attempt to create socket that requires XTEA, but CSP was compiled without XTEA support\r\n");
-		return NULL;
+		return CSP_ERR_NOTSUP;
 	}
 #endif
 
 #ifndef CSP_USE_HMAC
 	if (opts & CSP_SO_HMACREQ) {
 		csp_log_error("Attempt to create socket that requires HMAC, but CSP was compiled without HMAC support\r\n");
-		return NULL;
+		return CSP_ERR_NOTSUP;
 	} 
 #endif
 
 #ifndef CSP_USE_CRC32
 	if (opts & CSP_SO_CRC32REQ) {
 		csp_log_error("Attempt to create socket that requires CRC32, but CSP was compiled without CRC32 support\r\n");
-		return NULL;
+		return CSP_ERR_NOTSUP;
 	} 
 #endif
 	
 	/* Drop packet if reserved flags are set */
 	if (opts & ~(CSP_SO_RDPREQ | CSP_SO_XTEAREQ | CSP_SO_HMACREQ | CSP_SO_CRC32REQ | CSP_SO_CONN_LESS)) {
 		csp_log_error("Invalid socket option\r\n");
-		return NULL;
+		return CSP_ERR_INVAL;
 	}
 
+	return CSP_ERR_NONE;
+
+}
+
+csp_socket_t * csp_socket(uint32_t opts) {
+	
+	/* Validate socket options */
+	if (csp_socket_opts_check(opts) != CSP_ERR_NONE)
+		return NULL;
+
 	/* Use CSP buffers instead? */
 	csp_socket_t * sock = csp_conn_allocate(CONN_SERVER);
 	if (sock == NULL)
@@ -166,7 +175,10 @@ csp_conn_t * csp_accept(csp_socket_t * sock, uint32_t timeout) {
 		return NULL;
 
 	csp_conn_t * conn;
-	if (csp_queue_dequeue(sock->socket, &conn, timeout) == CSP_QUEUE_OK)
+	int result = csp_queue_dequeue(sock->socket, &conn, timeout);
+	csp_conn_rearm(sock, sock->socket);
+
+	if (result == CSP_QUEUE_OK)
 		return conn;
 
 	return NULL;
@@ -180,16 +192,27 @@ csp_packet_t * csp_read(csp_conn_t * conn, uint32_t timeout) {
 	if (conn == NULL || conn->state != CONN_OPEN)
 		return NULL;
 
+#ifdef CSP_USE_RDP
+	/* A fast open client that reads first has to open the connection now */
+	if (conn->idout.flags & CSP_FRDP)
+		csp_rdp_send_deferred_syn(conn);
+#endif
+
 #ifdef CSP_USE_QOS
 	int prio, event;
-	if (csp_queue_dequeue(conn->rx_event, &event, timeout) != CSP_QUEUE_OK)
+	if (csp_queue_dequeue(conn->rx_event, &event, timeout) != CSP_QUEUE_OK) {
+		csp_conn_rearm(conn, conn->rx_event);
 		return NULL;
+	}
 
 	for (prio = 0; prio < CSP_RX_QUEUES; prio++)
 		if (csp_queue_dequeue(conn->rx_queue[prio], &packet, 0) == CSP_QUEUE_OK)
 			break;
+	csp_conn_rearm(conn, conn->rx_event);
 #else
-	if (csp_queue_dequeue(conn->rx_queue[0], &packet, timeout) != CSP_QUEUE_OK)
+	int result = csp_queue_dequeue(conn->rx_queue[0], &packet, timeout);
+	csp_conn_rearm(conn, conn->rx_queue[0]);
+	if (result != CSP_QUEUE_OK)
 		return NULL;
 #endif
 
@@ -203,8 +226,93 @@ csp_packet_t * csp_read(csp_conn_t * conn, uint32_t timeout) {
 
 }
 
+/* Take up to count items from a queue, waiting at most timeout for the first */
+static unsigned int csp_dequeue_many(csp_queue_handle_t queue, void * buf, size_t item_size, unsigned int count, uint32_t timeout) {
+
+	unsigned int found = 0;
+	int items;
+
+	/* Some ports take fewer items per call than are waiting, so repeat until empty */
+	while (found < count) {
+		items = csp_queue_dequeue_many(queue, (uint8_t *) buf + found * item_size, count - found, found == 0 ? timeout : 0);
+		if (items <= 0)
+			break;
+		found += items;
+	}
+
+	return found;
+
+}
+
+int csp_read_many(csp_conn_t * conn, csp_packet_t ** packets, unsigned int count, uint32_t timeout) {
+
+	unsigned int found, i, j;
+
+	if (conn == NULL || conn->state != CONN_OPEN || packets == NULL || count == 0)
+		return 0;
+
+#ifdef CSP_USE_RDP
+	/* A fast open client that reads first has to open the connection now */
+	if (conn->idout.flags & CSP_FRDP)
+		csp_rdp_send_deferred_syn(conn);
+#endif
+
+#ifdef CSP_USE_QOS
+	int prio;
+	unsigned int events;
+	int tokens[CSP_CONN_QUEUE_LENGTH];
+
+	/* Wait for the first packet, and take the tokens of the packets already waiting */
+	if (count > CSP_CONN_QUEUE_LENGTH)
+		count = CSP_CONN_QUEUE_LENGTH;
+	events = csp_dequeue_many(conn->rx_event, tokens, sizeof(int), count, timeout);
+	if (events == 0) {
+		csp_conn_rearm(conn, conn->rx_event);
+		return 0;
+	}
+
+	/* Take packets with highest priority first */
+	found = 0;
+	for (prio = 0; prio < CSP_RX_QUEUES && found < events; prio++)
+		found += csp_dequeue_many(conn->rx_queue[prio], &packets[found], sizeof(csp_packet_t *), events - found, 0);
+	csp_conn_rearm(conn, conn->rx_event);
+
+	if (found < events)
+		csp_log_warn("Spurious wakeup of csp_read_many. No packet found\r\n");
+#else
+	found = csp_dequeue_many(conn->rx_queue[0], packets, sizeof(csp_packet_t *), count, timeout);
+	csp_conn_rearm(conn, conn->rx_queue[0]);
+#endif
+
+	/* A NULL packet tells that the connection was closed by the other end. Return
+	 * the packets before it, and leave it for the next call. Packets that arrived
+	 * after it belong to a closed connection, so they are dropped */
+	for (i = 0; i < found; i++)
+		if (packets[i] == NULL)
+			break;
+	if (i < found) {
+		for (j = i + 1; j < found; j++)
+			if (packets[j] != NULL)
+				csp_buffer_free(packets[j]);
+		found = i;
+		if (found > 0 && csp_conn_enqueue_packet(conn, NULL) != CSP_ERR_NONE)
+			csp_log_warn("Failed to queue close notification\r\n");
+	}
+
+#ifdef CSP_USE_RDP
+	/* Packets read could trigger ACK transmission */
+	if (found > 0 && conn->idin.flags & CSP_FRDP)
+		csp_rdp_check_ack(conn);
+#endif
+
+	return found;
+
+}
+
 int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 
+	csp_packet_t * shared = NULL;
+
 	if (packet == NULL) {
 		csp_log_error("csp_send_direct called with NULL packet\r\n");
 		goto err;
@@ -220,6 +328,18 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 	csp_log_packet("Output: Src %u, Dst %u, Dport %u, Sport %u, Pri %u, Flags 0x%02X, Size %u VIA: %s\r\n",
 		idout.src, idout.dst, idout.dport, idout.sport, idout.pri, idout.flags, packet->length, ifout->interface->name);
 
+	/* A buffer shared with e.g. the RDP retransmit window must stay intact, so
+	 * send a copy if trailers are appended or the interface modifies it */
+	if (csp_buffer_refcount(packet) > 1 && (!ifout->interface->tx_shared ||
+			(idout.src == my_address && (idout.flags & (CSP_FHMAC | CSP_FCRC32 | CSP_FXTEA))))) {
+		shared = packet;
+		packet = csp_buffer_clone(shared);
+		if (packet == NULL) {
+			csp_log_error("No buffer for copy of shared packet\r\n");
+			goto tx_err;
+		}
+	}
+
 #ifdef CSP_USE_PROMISC
 	/* Loopback traffic is added to promisc queue by the router */
 	if (idout.dst != my_address && idout.src == my_address) {
@@ -301,11 +421,18 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout) {
 	if ((*ifout->interface->nexthop)(packet, timeout) != CSP_ERR_NONE)
 		goto tx_err;
 
+	/* The interface owns the copy now, release the reference to the original */
+	if (shared != NULL)
+		csp_buffer_free(shared);
+
 	ifout->interface->tx++;
 	ifout->interface->txbytes += bytes;
 	return CSP_ERR_NONE;
 
 tx_err:
+	/* On error the caller keeps its reference to the original */
+	if (shared != NULL && packet != NULL)
+		csp_buffer_free(packet);
 	ifout->interface->tx_error++;
 err:
 	return CSP_ERR_TX;
@@ -323,6 +450,9 @@ int csp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
 #ifdef CSP_USE_RDP
 	if (conn->idout.flags & CSP_FRDP) {
+		/* The first segment of a fast open connection is sent with the SYN */
+		if (csp_rdp_send_fastopen(conn, packet) == CSP_ERR_NONE)
+			return 1;
 		if (csp_rdp_send(conn, packet, timeout) != CSP_ERR_NONE) {
 			csp_route_t * ifout = csp_route_if(conn->idout.dst);
 			if (ifout != NULL && ifout->interface != NULL)
@@ -344,10 +474,123 @@ int csp_send_prio(uint8_t prio, csp_conn_t * conn, csp_packet_t * packet, uint32
 	return csp_send(conn, packet, timeout);
 }
 
+/* Bytes appended to a packet by csp_send_direct for the given flags */
+static size_t csp_trailer_overhead(uint8_t flags) {
+
+	size_t overhead = 0;
+
+	if (flags & CSP_FHMAC)
+		overhead += CSP_HMAC_LENGTH;
+	if (flags & CSP_FCRC32)
+		overhead += sizeof(uint32_t);
+	if (flags & CSP_FXTEA)
+		overhead += sizeof(uint32_t);
+
+	return overhead;
+
+}
+
+/* Largest payload of a packet to dest, limited by the largest buffer and the interface MTU */
+static size_t csp_payload_size(uint8_t dest, size_t overhead) {
+
+	size_t size = csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD;
+	csp_route_t * ifout = csp_route_if(dest);
+	if (ifout != NULL && ifout->interface != NULL && ifout->interface->mtu > 0 && ifout->interface->mtu < size)
+		size = ifout->interface->mtu;
+
+	return (size > overhead) ? size - overhead : 0;
+
+}
+
+static int csp_iov_valid(const csp_iovec_t * iov, unsigned int iovcnt, size_t * total) {
+
+	unsigned int i;
+
+	if (iov == NULL && iovcnt > 0)
+		return 0;
+
+	*total = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].base == NULL && iov[i].len > 0)
+			return 0;
+		*total += iov[i].len;
+	}
+
+	return 1;
+
+}
+
+/**
+ * Fill a packet with the next size bytes of the blocks
+ * @param packet packet to fill
+ * @param iov blocks to send
+ * @param index block to continue from, updated
+ * @param offset bytes of that block already sent, updated
+ * @param size number of bytes to put in the packet
+ */
+static void csp_iov_packet(csp_packet_t * packet, const csp_iovec_t * iov, unsigned int * index, size_t * offset, size_t size) {
+
+	packet->length = 0;
+	while (packet->length < size) {
+		size_t chunk = iov[*index].len - *offset;
+		if (chunk > size - packet->length)
+			chunk = size - packet->length;
+		memcpy(&packet->data[packet->length], (const uint8_t *) iov[*index].base + *offset, chunk);
+		packet->length += chunk;
+		*offset += chunk;
+		if (*offset == iov[*index].len) {
+			(*index)++;
+			*offset = 0;
+		}
+	}
+
+}
+
+int csp_sendv(csp_conn_t * conn, const csp_iovec_t * iov, unsigned int iovcnt, uint32_t timeout) {
+
+	size_t total, sent = 0, offset = 0, overhead;
+	unsigned int index = 0;
+
+	if (conn == NULL || conn->state != CONN_OPEN || !csp_iov_valid(iov, iovcnt, &total))
+		return CSP_ERR_INVAL;
+
+#ifdef CSP_USE_RDP
+	if (conn->idout.flags & CSP_FRDP)
+		overhead = csp_rdp_segment_overhead(conn);
+	else
+#endif
+		overhead = csp_trailer_overhead(conn->idout.flags);
+
+	size_t mss = csp_payload_size(conn->idout.dst, overhead);
+	if (mss == 0)
+		return CSP_ERR_INVAL;
+
+	while (sent < total) {
+
+		size_t size = (total - sent < mss) ? total - sent : mss;
+
+		csp_packet_t * packet = csp_buffer_get_small_timeout(size + overhead, timeout);
+		if (packet == NULL)
+			return (sent > 0) ? (int) sent : CSP_ERR_NOMEM;
+
+		csp_iov_packet(packet, iov, &index, &offset, size);
+		if (!csp_send(conn, packet, timeout)) {
+			csp_buffer_free(packet);
+			break;
+		}
+
+		sent += size;
+
+	}
+
+	return sent;
+
+}
+
 int csp_transaction_persistent(csp_conn_t * conn, uint32_t timeout, void * outbuf, int outlen, void * inbuf, int inlen) {
 
-	int size = (inlen > outlen) ? inlen : outlen;
-	csp_packet_t * packet = csp_buffer_get(size);
+	/* The reply is read into a separate packet, so the request can be small */
+	csp_packet_t * packet = csp_buffer_get_small(outlen);
 	if (packet == NULL)
 		return 0;
 
@@ -403,11 +646,112 @@ csp_packet_t * csp_recvfrom(csp_socket_t * socket, uint32_t timeout) {
 
 	csp_packet_t * packet = NULL;
 	csp_queue_dequeue(socket->socket, &packet, timeout);
+	csp_conn_rearm(socket, socket->socket);
 
 	return packet;
 
 }
 
+int csp_recvfrom_many(csp_socket_t * socket, csp_packet_t ** packets, unsigned int count, uint32_t timeout) {
+
+	if ((socket == NULL) || (!(socket->opts & CSP_SO_CONN_LESS)) || packets == NULL)
+		return 0;
+
+	unsigned int found = csp_dequeue_many(socket->socket, packets, sizeof(csp_packet_t *), count, timeout);
+	csp_conn_rearm(socket, socket->socket);
+
+	return found;
+
+}
+
+/* Set revents on each entry, and count the entries that are ready */
+static int csp_poll_ready(csp_pollfd_t * fds, unsigned int nfds) {
+
+	unsigned int i;
+	int ready = 0;
+
+	for (i = 0; i < nfds; i++) {
+		csp_conn_t * conn = fds[i].conn;
+		fds[i].revents = 0;
+		if (conn == NULL)
+			continue;
+
+		if (fds[i].events & CSP_POLLIN) {
+			/* A closed connection is ready, csp_read returns NULL at once */
+			if (conn->state != CONN_OPEN)
+				fds[i].revents |= CSP_POLLIN;
+#ifdef CSP_USE_QOS
+			else if (csp_queue_size(conn->rx_event) > 0)
+#else
+			else if (csp_queue_size(conn->rx_queue[0]) > 0)
+#endif
+				fds[i].revents |= CSP_POLLIN;
+#ifdef CSP_USE_RDP
+			else if (conn->rdp.rx_stream != NULL)
+				fds[i].revents |= CSP_POLLIN;
+#endif
+		}
+
+		if ((fds[i].events & CSP_POLLACCEPT) && conn->socket != NULL && csp_queue_size(conn->socket) > 0)
+			fds[i].revents |= CSP_POLLACCEPT;
+
+		if (fds[i].revents)
+			ready++;
+	}
+
+	return ready;
+
+}
+
+int csp_poll(csp_pollfd_t * fds, unsigned int nfds, uint32_t timeout) {
+
+	csp_bin_sem_handle_t sem;
+	uint32_t start;
+	unsigned int i;
+
+	if (fds == NULL && nfds > 0)
+		return CSP_ERR_INVAL;
+
+	int ready = csp_poll_ready(fds, nfds);
+	if (ready > 0 || timeout == 0)
+		return ready;
+
+	if (csp_bin_sem_create(&sem) != CSP_SEMAPHORE_OK)
+		return CSP_ERR_NOMEM;
+	csp_bin_sem_wait(&sem, 0);
+
+	for (i = 0; i < nfds; i++) {
+		if (fds[i].conn != NULL && csp_conn_poll_add(fds[i].conn, &sem) != CSP_ERR_NONE) {
+			csp_log_error("Connection is already polled by another task\r\n");
+			ready = CSP_ERR_BUSY;
+			goto out;
+		}
+	}
+
+	/* Check again, a packet may have arrived before the semaphore was set */
+	start = csp_get_ms();
+	while ((ready = csp_poll_ready(fds, nfds)) == 0) {
+		uint32_t remaining = CSP_MAX_DELAY;
+		if (timeout != CSP_MAX_DELAY) {
+			uint32_t elapsed = csp_get_ms() - start;
+			if (elapsed >= timeout)
+				break;
+			remaining = timeout - elapsed;
+		}
+		csp_bin_sem_wait(&sem, remaining);
+	}
+
+out:
+	/* Entries polled by another task are left alone */
+	for (i = 0; i < nfds; i++)
+		if (fds[i].conn != NULL)
+			csp_conn_poll_remove(fds[i].conn, &sem);
+	csp_bin_sem_remove(&sem);
+
+	return ready;
+
+}
+
 int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t * packet, uint32_t timeout) {
 
 	packet->id.flags = 0;
@@ -463,3 +807,46 @@ int csp_sendto_reply(csp_packet_t * request_packet, csp_packet_t * reply_packet,
 
 	return csp_sendto(request_packet->id.pri, request_packet->id.src, request_packet->id.sport, request_packet->id.dport, opts, reply_packet, timeout);
 }
+
+int csp_sendtov(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, const csp_iovec_t * iov, unsigned int iovcnt, uint32_t timeout) {
+
+	size_t total, sent = 0, offset = 0;
+	unsigned int index = 0;
+	uint8_t flags = 0;
+
+	if ((opts & CSP_O_RDP) || !csp_iov_valid(iov, iovcnt, &total))
+		return CSP_ERR_INVAL;
+
+	if (opts & CSP_O_HMAC)
+		flags |= CSP_FHMAC;
+	if (opts & CSP_O_XTEA)
+		flags |= CSP_FXTEA;
+	if (opts & CSP_O_CRC32)
+		flags |= CSP_FCRC32;
+
+	size_t overhead = csp_trailer_overhead(flags);
+	size_t mss = csp_payload_size(dest, overhead);
+	if (mss == 0)
+		return CSP_ERR_INVAL;
+
+	while (sent < total) {
+
+		size_t size = (total - sent < mss) ? total - sent : mss;
+
+		csp_packet_t * packet = csp_buffer_get_small_timeout(size + overhead, timeout);
+		if (packet == NULL)
+			return (sent > 0) ? (int) sent : CSP_ERR_NOMEM;
+
+		csp_iov_packet(packet, iov, &index, &offset, size);
+		if (csp_sendto(prio, dest, dport, src_port, opts, packet, timeout) != CSP_ERR_NONE) {
+			csp_buffer_free(packet);
+			break;
+		}
+
+		sent += size;
+
+	}
+
+	return sent;
+
+}
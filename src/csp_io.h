@@ -39,6 +39,13 @@ extern "C" {
  */
 int csp_send_direct(csp_id_t idout, csp_packet_t * packet, uint32_t timeout);
 
+/**
+ * Check socket options against the features CSP was compiled with
+ * @param opts CSP_SO_x
+ * @return CSP_ERR_NONE, CSP_ERR_NOTSUP for a feature that is not compiled in, or CSP_ERR_INVAL for an unknown option
+ */
+int csp_socket_opts_check(uint32_t opts);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -30,6 +30,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/arch/csp_queue.h>
 #include <csp/arch/csp_semaphore.h>
 
+#include "csp_io.h"
 #include "csp_port.h"
 #include "csp/csp_conn.h"
 
@@ -53,6 +54,28 @@ csp_socket_t * csp_port_get_socket(unsigned int port) {
 
 }
 
+csp_callback_t csp_port_get_callback(unsigned int port, void ** ctx, uint32_t * opts) {
+
+	csp_port_t * entry = NULL;
+
+	if (port > CSP_ANY)
+		return NULL;
+
+	/* Same matching as csp_port_get_socket */
+	if (ports[port].state == PORT_OPEN)
+		entry = &ports[port];
+	else if (ports[CSP_ANY].state == PORT_OPEN)
+		entry = &ports[CSP_ANY];
+
+	if (entry == NULL || entry->callback == NULL)
+		return NULL;
+
+	*ctx = entry->callback_ctx;
+	*opts = entry->callback_opts;
+	return entry->callback;
+
+}
+
 int csp_port_init(void) {
 
 	memset(ports, PORT_CLOSED, sizeof(csp_port_t) * (CSP_MAX_BIND_PORT + 2));
@@ -100,4 +123,42 @@ int csp_bind(csp_socket_t * socket, uint8_t port) {
 
 }
 
+int csp_bind_callback(uint8_t port, uint32_t opts, csp_callback_t callback, void * ctx) {
+
+	if (callback == NULL)
+		return CSP_ERR_INVAL;
+
+	/* RDP needs a connection, which a callback port does not have */
+	if (opts & CSP_SO_RDPREQ) {
+		csp_log_error("RDP is not supported on callback port %u\r\n", port);
+		return CSP_ERR_NOTSUP;
+	}
+
+	int ret = csp_socket_opts_check(opts);
+	if (ret != CSP_ERR_NONE)
+		return ret;
+
+	if (port > CSP_ANY) {
+		csp_log_error("Only ports from 0-%u (and CSP_ANY for default) are available for incoming ports\r\n", CSP_ANY);
+		return CSP_ERR_INVAL;
+	}
+
+	if (ports[port].state != PORT_CLOSED) {
+		csp_log_error("Port %d is already in use\r\n", port);
+		return CSP_ERR_USED;
+	}
+
+	csp_log_info("Binding callback %p to port %u\r\n", callback, port);
+
+	/* Set the callback before the router can see the port open */
+	ports[port].socket = NULL;
+	ports[port].callback = callback;
+	ports[port].callback_ctx = ctx;
+	ports[port].callback_opts = opts;
+	ports[port].state = PORT_OPEN;
+
+	return CSP_ERR_NONE;
+
+}
+
 
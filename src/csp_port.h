@@ -39,6 +39,9 @@ typedef enum {
 typedef struct {
 	csp_port_state_t state;		 // Port state
 	csp_socket_t * socket;		  // New connections are added to this socket's conn queue
+	csp_callback_t callback;		// Called from the router for each packet, instead of a socket
+	void * callback_ctx;			// Passed to callback
+	uint32_t callback_opts;			// Socket options the packets for callback must meet
 } csp_port_t;
 
 /**
@@ -48,6 +51,15 @@ int csp_port_init(void);
 
 csp_socket_t * csp_port_get_socket(unsigned int dport);
 
+/**
+ * Get the callback a port is bound to
+ * @param dport destination port of a packet
+ * @param ctx set to the context given to csp_bind_callback
+ * @param opts set to the socket options given to csp_bind_callback
+ * @return callback, or NULL if the port is not bound to one
+ */
+csp_callback_t csp_port_get_callback(unsigned int dport, void ** ctx, uint32_t * opts);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
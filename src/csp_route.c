@@ -52,11 +52,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 static csp_iface_t * interfaces;
 static csp_route_t routes[CSP_ROUTE_COUNT];
 
-static csp_thread_handle_t handle_router;
+static csp_thread_handle_t handle_router[CSP_ROUTER_WORKERS];
 
-static csp_queue_handle_t router_input_fifo[CSP_ROUTE_FIFOS];
+static csp_queue_handle_t router_input_fifo[CSP_ROUTER_WORKERS][CSP_ROUTE_FIFOS];
 #ifdef CSP_USE_QOS
-static csp_queue_handle_t router_input_event;
+static csp_queue_handle_t router_input_event[CSP_ROUTER_WORKERS];
 #endif
 
 #ifdef CSP_USE_PROMISC
@@ -65,11 +65,15 @@ int csp_promisc_enabled = 0;
 #endif
 
 #ifdef CSP_USE_RDP
-#define CSP_ROUTER_RX_TIMEOUT 100				//! If RDP is enabled, the router needs to awake some times to check timeouts
+#define CSP_ROUTER_RX_TIMEOUT 100				//! If RDP is enabled, the router wakes up at least this often to check timeouts
 #else
 #define CSP_ROUTER_RX_TIMEOUT CSP_MAX_DELAY		//! If no RDP, the router can sleep untill data arrives
 #endif
 
+#ifndef CSP_ROUTER_BATCH
+#define CSP_ROUTER_BATCH 1						//! Maximum number of packets routed per wakeup
+#endif
+
 typedef struct {
 	csp_iface_t * interface;
 	csp_packet_t * packet;
@@ -161,27 +165,31 @@ static int csp_route_security_check(uint32_t security_opts, csp_iface_t * interf
 
 int csp_route_table_init(void) {
 
-	int prio;
+	int prio, worker;
 
 	/* Clear routing table */
 	memset(routes, 0, sizeof(csp_route_t) * CSP_ROUTE_COUNT);
 
-	/* Create router fifos for each priority */
-	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
-		if (router_input_fifo[prio] == NULL) {
-			router_input_fifo[prio] = csp_queue_create(CSP_FIFO_INPUT, sizeof(csp_route_queue_t));
-			if (!router_input_fifo[prio])
-				return CSP_ERR_NOMEM;
+	for (worker = 0; worker < CSP_ROUTER_WORKERS; worker++) {
+
+		/* Create router fifos for each priority */
+		for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
+			if (router_input_fifo[worker][prio] == NULL) {
+				router_input_fifo[worker][prio] = csp_queue_create(CSP_FIFO_INPUT, sizeof(csp_route_queue_t));
+				if (!router_input_fifo[worker][prio])
+					return CSP_ERR_NOMEM;
+			}
 		}
-	}
 
 #ifdef CSP_USE_QOS
-	/* Create QoS fifo notification queue */
-	router_input_event = csp_queue_create(CSP_FIFO_INPUT, sizeof(int));
-	if (!router_input_event)
-		return CSP_ERR_NOMEM;
+		/* Create QoS fifo notification queue, with room for a token for every queued packet */
+		router_input_event[worker] = csp_queue_create(CSP_FIFO_INPUT * CSP_ROUTE_FIFOS, sizeof(int));
+		if (!router_input_event[worker])
+			return CSP_ERR_NOMEM;
 #endif
 
+	}
+
 	/* Register loopback route */
 	csp_route_set(my_address, &csp_if_lo, CSP_NODE_MAC);
 
@@ -200,186 +208,262 @@ void csp_route_table_save(uint8_t route_table_out[CSP_ROUTE_TABLE_SIZE]) {
 	memcpy(route_table_out, routes, sizeof(csp_route_t) * CSP_ROUTE_COUNT);
 }
 
-int csp_route_next_packet(csp_route_queue_t * input) {
+/**
+ * Get the next batch of packets to route.
+ * Blocks until the first packet arrives, and then picks up to count - 1
+ * further packets that are already waiting, without blocking again.
+ * With QoS enabled, every packet is taken from the highest priority fifo
+ * that is not empty, so the batch is in strict priority order.
+ * @param worker router worker to get packets for
+ * @param input array of at least count elements
+ * @param count maximum number of packets to get
+ * @param timeout time to wait for the first packet
+ * @return number of packets stored in input
+ */
+static int csp_route_next_packets(int worker, csp_route_queue_t input[], int count, uint32_t timeout) {
+
+	int found = 0;
 
 #ifdef CSP_USE_QOS
-	int prio, found, event;
+	int prio, events, event;
 
 	/* Wait for packet in any queue */
-	if (csp_queue_dequeue(router_input_event, &event, CSP_ROUTER_RX_TIMEOUT) != CSP_QUEUE_OK)
-		return CSP_ERR_TIMEDOUT;
+	if (csp_queue_dequeue(router_input_event[worker], &event, timeout) != CSP_QUEUE_OK)
+		return 0;
 
-	/* Find packet with highest priority */
-	found = 0;
-	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
-		if (csp_queue_dequeue(router_input_fifo[prio], input, 0) == CSP_QUEUE_OK) {
-			found = 1;
+	/* Collect tokens for packets that are already waiting */
+	for (events = 1; events < count; events++)
+		if (csp_queue_dequeue(router_input_event[worker], &event, 0) != CSP_QUEUE_OK)
 			break;
-		}
+
+	/* Find packets with highest priority */
+	while (found < events) {
+		for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++)
+			if (csp_queue_dequeue(router_input_fifo[worker][prio], &input[found], 0) == CSP_QUEUE_OK)
+				break;
+		if (prio == CSP_ROUTE_FIFOS)
+			break;
+		found++;
 	}
 
-	if (!found) {
+	if (found < events)
 		csp_log_warn("Spurious wakeup of router task. No packet found\r\n");
-		return CSP_ERR_TIMEDOUT;
-	}
 #else
-	if (csp_queue_dequeue(router_input_fifo[0], input, CSP_ROUTER_RX_TIMEOUT) != CSP_QUEUE_OK)
-		return CSP_ERR_TIMEDOUT;
+	if (csp_queue_dequeue(router_input_fifo[worker][0], &input[0], timeout) != CSP_QUEUE_OK)
+		return 0;
+
+	for (found = 1; found < count; found++)
+		if (csp_queue_dequeue(router_input_fifo[worker][0], &input[found], 0) != CSP_QUEUE_OK)
+			break;
 #endif
 
-	return CSP_ERR_NONE;
+	return found;
 
 }
 
-CSP_DEFINE_TASK(csp_task_router) {
+/**
+ * Route a single input packet.
+ * Forwards packets for other nodes, and delivers packets for this node
+ * to a connection-less socket or to the transport layer of a connection.
+ * @param input packet and incoming interface
+ */
+static void csp_route_packet(csp_route_queue_t * input) {
 
-	int prio;
-	csp_route_queue_t input;
-	csp_packet_t * packet;
+	csp_packet_t * packet = input->packet;
 	csp_conn_t * conn;
 	csp_socket_t * socket;
 	csp_route_t * dst;
+	int checked = 0;
 
-	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
-		if (!router_input_fifo[prio]) {
-			csp_log_error("Router %d not initialized\r\n", prio);
-			csp_thread_exit();
-		}
-	}
-
-	/* Here there be routing */
-	while (1) {
+	csp_log_packet("Input: Src %u, Dst %u, Dport %u, Sport %u, Pri %u, Flags 0x%02X, Size %"PRIu16"\r\n",
+			packet->id.src, packet->id.dst, packet->id.dport,
+			packet->id.sport, packet->id.pri, packet->id.flags, packet->length);
 
-#ifdef CSP_USE_RDP
-		/* Check connection timeouts (currently only for RDP) */
-		csp_conn_check_timeouts();
+	/* Here there be promiscuous mode */
+#ifdef CSP_USE_PROMISC
+	csp_promisc_add(packet, csp_promisc_queue);
 #endif
 
-		/* Get next packet to route */
-		if (csp_route_next_packet(&input) != CSP_ERR_NONE)
-			continue;
+	/* If the message is not to me, route the message to the correct interface */
+	if ((packet->id.dst != my_address) && (packet->id.dst != CSP_BROADCAST_ADDR)) {
 
-		packet = input.packet;
+		/* Find the destination interface */
+		dst = csp_route_if(packet->id.dst);
 
-		csp_log_packet("Input: Src %u, Dst %u, Dport %u, Sport %u, Pri %u, Flags 0x%02X, Size %"PRIu16"\r\n",
-				packet->id.src, packet->id.dst, packet->id.dport,
-				packet->id.sport, packet->id.pri, packet->id.flags, packet->length);
-
-		/* Here there be promiscuous mode */
-#ifdef CSP_USE_PROMISC
-		csp_promisc_add(packet, csp_promisc_queue);
-#endif
+		/* If the message resolves to the input interface, don't loop it back out */
+		if ((dst == NULL) || ((dst->interface == input->interface) && (input->interface->split_horizon_off == 0))) {
+			csp_buffer_free(packet);
+			return;
+		}
 
-		/* If the message is not to me, route the message to the correct interface */
-		if ((packet->id.dst != my_address) && (packet->id.dst != CSP_BROADCAST_ADDR)) {
+		/* Otherwise, actually send the message */
+		if (csp_send_direct(packet->id, packet, 0) != CSP_ERR_NONE) {
+			csp_log_warn("Router failed to send\r\n");
+			csp_buffer_free(packet);
+		}
 
-			/* Find the destination interface */
-			dst = csp_route_if(packet->id.dst);
+		/* Next message, please */
+		return;
 
-			/* If the message resolves to the input interface, don't loop it back out */
-			if ((dst == NULL) || ((dst->interface == input.interface) && (input.interface->split_horizon_off == 0))) {
-				csp_buffer_free(packet);
-				continue;
-			}
+	}
 
-			/* Otherwise, actually send the message */
-			if (csp_send_direct(packet->id, packet, 0) != CSP_ERR_NONE) {
-				csp_log_warn("Router failed to send\r\n");
-				csp_buffer_free(packet);
-			}
+	/* Ports bound to a callback are served here, without a socket or connection */
+	void * callback_ctx;
+	uint32_t callback_opts;
+	csp_callback_t callback = csp_port_get_callback(packet->id.dport, &callback_ctx, &callback_opts);
+	if (callback != NULL) {
+		if (packet->id.flags & CSP_FRDP) {
+			csp_log_warn("RDP packet for callback port %u. Discarding packet\r\n", packet->id.dport);
+			csp_buffer_free(packet);
+			return;
+		}
+		if (csp_route_security_check(callback_opts, input->interface, packet) < 0) {
+			csp_buffer_free(packet);
+			return;
+		}
+		callback(packet, callback_ctx);
+		return;
+	}
 
-			/* Next message, please */
-			continue;
+	/* The message is to me, search for incoming socket */
+	socket = csp_port_get_socket(packet->id.dport);
 
+	/* If the socket is connection-less, deliver now */
+	if (socket && (socket->opts & CSP_SO_CONN_LESS)) { 
+		if (csp_route_security_check(socket->opts, input->interface, packet) < 0) {
+			csp_buffer_free(packet);
+			return;
+		}
+		if (csp_queue_enqueue(socket->socket, &packet, 0) != CSP_QUEUE_OK) {
+			csp_log_error("Conn-less socket queue full\r\n");
+			csp_buffer_free(packet);
+			return;
 		}
+		csp_conn_notify(socket);
+		return;
+	}
 
-		/* The message is to me, search for incoming socket */
-		socket = csp_port_get_socket(packet->id.dport);
+	/* Search for an existing connection */
+	conn = csp_conn_find(packet->id.ext, CSP_ID_CONN_MASK);
 
-		/* If the socket is connection-less, deliver now */
-		if (socket && (socket->opts & CSP_SO_CONN_LESS)) { 
-			if (csp_route_security_check(socket->opts, input.interface, packet) < 0) {
-				csp_buffer_free(packet);
-				continue;
-			}
-			if (csp_queue_enqueue(socket->socket, &packet, 0) != CSP_QUEUE_OK) {
-				csp_log_error("Conn-less socket queue full\r\n");
+	/* If no connection was found, try to create a new one */
+	if (conn == NULL) {
+
+#ifdef CSP_USE_RDP
+		/* Late segments for a closed connection must not open a new one */
+		uint32_t opts;
+		if ((packet->id.flags & CSP_FRDP) && csp_rdp_quarantined(packet->id.ext, &opts)) {
+			if (csp_route_security_check(opts, input->interface, packet) < 0 || csp_rdp_quarantine_check(packet)) {
 				csp_buffer_free(packet);
-				continue;
+				return;
 			}
-			continue;
+			checked = 1;
 		}
+#endif
 
-		/* Search for an existing connection */
-		conn = csp_conn_find(packet->id.ext, CSP_ID_CONN_MASK);
+		/* Reject packet if no matching socket is found */
+		if (!socket) {
+			csp_buffer_free(packet);
+			return;
+		}
 
-		/* If no connection was found, try to create a new one */
-		if (conn == NULL) {
+		/* New incoming connection accepted */
+		csp_id_t idout;
+		idout.pri   = packet->id.pri;
+		idout.src   = my_address;
+		idout.dst   = packet->id.src;
+		idout.dport = packet->id.sport;
+		idout.sport = packet->id.dport;
+		idout.flags = packet->id.flags;
 
-			/* Reject packet if no matching socket is found */
-			if (!socket) {
-				csp_buffer_free(packet);
-				continue;
-			}
+		/* Create connection */
+		conn = csp_conn_new(packet->id, idout);
 
-			/* New incoming connection accepted */
-			csp_id_t idout;
-			idout.pri   = packet->id.pri;
-			idout.src   = my_address;
-			idout.dst   = packet->id.src;
-			idout.dport = packet->id.sport;
-			idout.sport = packet->id.dport;
-			idout.flags = packet->id.flags;
+		if (!conn) {
+			csp_log_error("No more connections available\r\n");
+			csp_buffer_free(packet);
+			return;
+		}
 
-			/* Create connection */
-			conn = csp_conn_new(packet->id, idout);
+		/* Store the socket queue and options */
+		conn->socket = socket->socket;
+		conn->listener = socket;
+		conn->opts = socket->opts;
 
-			if (!conn) {
-				csp_log_error("No more connections available\r\n");
-				csp_buffer_free(packet);
-				continue;
-			}
+	}
+
+	/* Run security check on incoming packet */
+	if (!checked && csp_route_security_check(conn->opts, input->interface, packet) < 0) {
+		csp_buffer_free(packet);
+		return;
+	}
 
-			/* Store the socket queue and options */
-			conn->socket = socket->socket;
-			conn->opts = socket->opts;
+	/* Pass packet to the right transport module */
+	if (packet->id.flags & CSP_FRDP) {
+#ifdef CSP_USE_RDP
+		csp_rdp_new_packet(conn, packet);
+	} else if (conn->opts & CSP_SO_RDPREQ) {
+		csp_log_warn("Received packet without RDP header. Discarding packet\r\n");
+		input->interface->rx_error++;
+		csp_buffer_free(packet);
+#else
+		csp_log_error("Received RDP packet, but CSP was compiled without RDP support. Discarding packet\r\n");
+		input->interface->rx_error++;
+		csp_buffer_free(packet);
+#endif
+	} else {
+		/* Pass packet to UDP module */
+		csp_udp_new_packet(conn, packet);
+	}
 
-		}
+}
 
-		/* Run security check on incoming packet */
-		if (csp_route_security_check(conn->opts, input.interface, packet) < 0) {
-			csp_buffer_free(packet);
-			continue;
+CSP_DEFINE_TASK(csp_task_router) {
+
+	int prio, i, count;
+	int worker = (intptr_t) param;
+	uint32_t timeout = CSP_ROUTER_RX_TIMEOUT;
+	csp_route_queue_t input[CSP_ROUTER_BATCH];
+
+	for (prio = 0; prio < CSP_ROUTE_FIFOS; prio++) {
+		if (!router_input_fifo[worker][prio]) {
+			csp_log_error("Router %d not initialized\r\n", prio);
+			csp_thread_exit();
 		}
+	}
+
+	/* Here there be routing */
+	while (1) {
 
-		/* Pass packet to the right transport module */
-		if (packet->id.flags & CSP_FRDP) {
 #ifdef CSP_USE_RDP
-			csp_rdp_new_packet(conn, packet);
-		} else if (conn->opts & CSP_SO_RDPREQ) {
-			csp_log_warn("Received packet without RDP header. Discarding packet\r\n");
-			input.interface->rx_error++;
-			csp_buffer_free(packet);
-#else
-			csp_log_error("Received RDP packet, but CSP was compiled without RDP support. Discarding packet\r\n");
-			input.interface->rx_error++;
-			csp_buffer_free(packet);
+		/* Check connection timeouts (currently only for RDP) */
+		csp_conn_check_timeouts(worker);
+
+		/* Sleep until the next connection deadline at most */
+		timeout = csp_conn_next_timeout(worker, CSP_ROUTER_RX_TIMEOUT);
 #endif
-		} else {
-			/* Pass packet to UDP module */
-			csp_udp_new_packet(conn, packet);
-		}
+
+		/* Get next batch of packets to route */
+		count = csp_route_next_packets(worker, input, CSP_ROUTER_BATCH, timeout);
+
+		for (i = 0; i < count; i++)
+			csp_route_packet(&input[i]);
+
 	}
 
 }
 
 int csp_route_start_task(unsigned int task_stack_size, unsigned int priority) {
 
-	int ret = csp_thread_create(csp_task_router, (signed char *) "RTE", task_stack_size, NULL, priority, &handle_router);
+	int worker;
+
+	for (worker = 0; worker < CSP_ROUTER_WORKERS; worker++) {
+		int ret = csp_thread_create(csp_task_router, (signed char *) "RTE", task_stack_size, (void *) (intptr_t) worker, priority, &handle_router[worker]);
 
-	if (ret != 0) {
-		csp_log_error("Failed to start router task\n");
-		return CSP_ERR_NOMEM;
+		if (ret != 0) {
+			csp_log_error("Failed to start router task\n");
+			return CSP_ERR_NOMEM;
+		}
 	}
 
 	return CSP_ERR_NONE;
@@ -466,9 +550,10 @@ csp_route_t * csp_route_if(uint8_t id) {
 
 }
 
-int csp_route_enqueue(csp_queue_handle_t handle, void * value, uint32_t timeout, CSP_BASE_TYPE * pxTaskWoken) {
+int csp_route_enqueue(int worker, int fifo, void * value, uint32_t timeout, CSP_BASE_TYPE * pxTaskWoken) {
 
 	int result;
+	csp_queue_handle_t handle = router_input_fifo[worker][fifo];
 
 	if (pxTaskWoken == NULL)
 		result = csp_queue_enqueue(handle, value, timeout);
@@ -480,9 +565,9 @@ int csp_route_enqueue(csp_queue_handle_t handle, void * value, uint32_t timeout,
 
 	if (result == CSP_QUEUE_OK) {
 		if (pxTaskWoken == NULL)
-			csp_queue_enqueue(router_input_event, &event, 0);
+			csp_queue_enqueue(router_input_event[worker], &event, 0);
 		else
-			csp_queue_enqueue_isr(router_input_event, &event, pxTaskWoken);
+			csp_queue_enqueue_isr(router_input_event[worker], &event, pxTaskWoken);
 	}
 #endif
 
@@ -490,6 +575,17 @@ int csp_route_enqueue(csp_queue_handle_t handle, void * value, uint32_t timeout,
 
 }
 
+int csp_route_get_worker(uint32_t id) {
+
+#if CSP_ROUTER_WORKERS > 1
+	/* Fibonacci hash of the connection tuple */
+	return ((uint32_t) ((id & CSP_ID_CONN_MASK) * 2654435761U) >> 16) % CSP_ROUTER_WORKERS;
+#else
+	return 0;
+#endif
+
+}
+
 int csp_route_get_fifo(int prio) {
 
 #ifdef CSP_USE_QOS
@@ -516,12 +612,28 @@ void csp_new_packet(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TYP
 		return;
 	}
 
+	/* Unless the interface opts in, the application must get a full size buffer */
+	if (!interface->rx_small && csp_buffer_element_size(packet) < csp_buffer_size()) {
+		csp_packet_t * full = (pxTaskWoken == NULL) ? csp_buffer_get(packet->length) : csp_buffer_get_isr(packet->length);
+		if (full != NULL)
+			memcpy(full, packet, CSP_BUFFER_PACKET_OVERHEAD + packet->length);
+		if (pxTaskWoken == NULL)
+			csp_buffer_free(packet);
+		else
+			csp_buffer_free_isr(packet);
+		if (full == NULL) {
+			interface->drop++;
+			return;
+		}
+		packet = full;
+	}
+
 	csp_route_queue_t queue_element;
 	queue_element.interface = interface;
 	queue_element.packet = packet;
 
 	fifo = csp_route_get_fifo(packet->id.pri);
-	result = csp_route_enqueue(router_input_fifo[fifo], &queue_element, 0, pxTaskWoken);
+	result = csp_route_enqueue(csp_route_get_worker(packet->id.ext), fifo, &queue_element, 0, pxTaskWoken);
 
 	if (result != CSP_ERR_NONE) {
 		csp_log_warn("ERROR: Routing input FIFO is FULL. Dropping packet.\r\n");
@@ -32,6 +32,10 @@ extern "C" {
 #include <csp/arch/csp_thread.h>
 #include <csp/arch/csp_queue.h>
 
+#ifndef CSP_ROUTER_WORKERS
+#define CSP_ROUTER_WORKERS 1	//! Number of router tasks
+#endif
+
 typedef struct __attribute__((__packed__)) {
 	csp_iface_t * interface;
 	uint8_t nexthop_mac_addr;
@@ -52,6 +56,15 @@ int csp_route_table_init(void);
  */
 csp_route_t * csp_route_if(uint8_t id);
 
+/**
+ * Find the router worker that handles a connection
+ * All packets of a connection are routed by the same worker, so
+ * the connection state is only ever touched by a single router task.
+ * @param id CSP identifier of an incoming packet, or idin of a connection
+ * @return worker index, from 0 to CSP_ROUTER_WORKERS - 1
+ */
+int csp_route_get_worker(uint32_t id);
+
 /**
  * Interface lookup by name
  * @param name NUL terminated interface name
@@ -44,7 +44,7 @@ int csp_ping(uint8_t node, uint32_t timeout, unsigned int size, uint8_t conn_opt
 
 	/* Prepare data */
 	csp_packet_t * packet;
-	packet = csp_buffer_get(size);
+	packet = csp_buffer_get_small(size);
 	if (packet == NULL)
 		goto out;
 
@@ -90,7 +90,7 @@ void csp_ping_noreply(uint8_t node) {
 
 	/* Prepare data */
 	csp_packet_t * packet;
-	packet = csp_buffer_get(1);
+	packet = csp_buffer_get_small(1);
 
 	/* Check malloc */
 	if (packet == NULL)
@@ -130,7 +130,7 @@ void csp_ps(uint8_t node, uint32_t timeout) {
 
 	/* Prepare data */
 	csp_packet_t * packet;
-	packet = csp_buffer_get(95);
+	packet = csp_buffer_get_small(1);
 
 	/* Check malloc */
 	if (packet == NULL)
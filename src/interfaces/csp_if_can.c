@@ -442,6 +442,7 @@ static int csp_can_process_frame(can_frame_t *frame) {
 
 	pbuf_element_t *buf;
 	uint8_t offset;
+	uint16_t length;
 	
 	can_id_t id = frame->id;
 
@@ -479,14 +480,27 @@ static int csp_can_process_frame(can_frame_t *frame) {
 				break;
 			}
 						
+			/* Read the length first, it sizes a small buffer */
+			memcpy(&length, frame->data + sizeof(csp_id_t), sizeof(uint16_t));
+			length = csp_ntoh16(length);
+
 			/* Check for incomplete frame */
 			if (buf->packet != NULL) {
-				/* Reuse the buffer */
 				csp_log_warn("Incomplete frame\r\n");
 				csp_if_can.frame++;
-			} else {
+				/* Reuse the buffer, unless it may be too small */
+				if (csp_if_can.rx_small) {
+					csp_buffer_free(buf->packet);
+					buf->packet = NULL;
+				}
+			}
+
+			if (buf->packet == NULL) {
 				/* Allocate memory for frame */
-				buf->packet = csp_buffer_get(csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD);
+				if (csp_if_can.rx_small)
+					buf->packet = csp_buffer_get_small(length);
+				else
+					buf->packet = csp_buffer_get(csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD);
 				if (buf->packet == NULL) {
 					csp_log_error("Failed to get buffer for CSP_BEGIN packet\r\n");
 					csp_if_can.frame++;
@@ -498,8 +512,7 @@ static int csp_can_process_frame(can_frame_t *frame) {
 			/* Copy CSP identifier and length*/
 			memcpy(&(buf->packet->id), frame->data, sizeof(csp_id_t));
 			buf->packet->id.ext = csp_ntoh32(buf->packet->id.ext);
-			memcpy(&(buf->packet->length), frame->data + sizeof(csp_id_t), sizeof(uint16_t));
-			buf->packet->length = csp_ntoh16(buf->packet->length);
+			buf->packet->length = length;
 			
 			/* Reset RX count */
 			buf->rx_count = 0;
@@ -717,4 +730,5 @@ csp_iface_t csp_if_can = {
 	.name = "CAN",
 	.nexthop = csp_can_tx,
 	.mtu = CSP_CAN_MTU,
+	.tx_shared = 1,
 };
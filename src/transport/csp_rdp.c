@@ -36,10 +36,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/arch/csp_queue.h>
 #include <csp/arch/csp_semaphore.h>
 #include <csp/arch/csp_malloc.h>
+#include <csp/arch/csp_thread.h>
 #include <csp/arch/csp_time.h>
 #include "../csp_port.h"
 #include <csp/csp_conn.h>
 #include "../csp_io.h"
+#include "../csp_route.h"
+#include "../crypto/csp_hmac.h"
 #include "csp_transport.h"
 
 #ifdef CSP_USE_RDP
@@ -49,15 +52,59 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define RDP_EAK 0x04
 #define RDP_RST	0x08
 
+/* Options negotiated in the 7th word of the SYN and in the SYN/ACK */
+#define RDP_OPT_EACK_BITMAP	0x01		// EACK carries a base sequence number and a bitmap
+#define RDP_OPT_FASTOPEN	0x02		// Data after the SYN parameters is delivered on accept
+#define RDP_OPT_RWND		0x04		// ACKs advertise the room in the receiver's RX queue
+#define RDP_OPT_SUPPORTED	(RDP_OPT_EACK_BITMAP | RDP_OPT_FASTOPEN | RDP_OPT_RWND)
+
+/* Length of the parameters at the start of a SYN */
+#define RDP_SYN_LENGTH		(7 * sizeof(uint32_t))
+
+/* Fast open progress of a client connection */
+#define RDP_FO_NONE			0			// Normal handshake
+#define RDP_FO_DEFERRED		1			// SYN is sent with the first segment
+#define RDP_FO_SENT			2			// SYN carried the first segment
+
+/* A deferred SYN is sent without data if the application has not sent within this time, in ms */
+#define RDP_FO_DELAY		100
+
 static uint32_t csp_rdp_window_size = 4;
 static uint32_t csp_rdp_conn_timeout = 10000;
 static uint32_t csp_rdp_packet_timeout = 1000;
 static uint32_t csp_rdp_delayed_acks = 1;
 static uint32_t csp_rdp_ack_timeout = 1000 / 4;
 static uint32_t csp_rdp_ack_delay_count = 4 / 2;
+static uint32_t csp_rdp_rto_min = 100;
+static uint32_t csp_rdp_rto_max = 10000;
+static uint32_t csp_rdp_fast_retransmit = 3;
+static uint32_t csp_rdp_cc = 0;
+
+/* Options last agreed with each peer, lets fast open skip the negotiation */
+static uint32_t csp_rdp_peer_options[CSP_ID_HOST_MAX + 1];
+
+#if CSP_RDP_QUARANTINE > 0
+/* A closed connection, held in place of a connection in CLOSE-WAIT */
+typedef struct {
+	uint32_t id;				// Incoming identifier, masked with CSP_ID_CONN_MASK
+	csp_id_t idout;				// Outgoing identifier, for the RST reply
+	uint32_t opts;				// Connection options, for the security check
+	uint32_t expires;			// Time the entry is released
+	uint16_t snd_nxt;			// Sequence number of the RST reply
+	uint16_t rcv_cur;			// Last segment received from the peer
+	uint16_t rcv_irs;			// Sequence number of the SYN from the peer
+	uint8_t used;
+} rdp_quarantine_t;
+
+static rdp_quarantine_t csp_rdp_quarantine[CSP_RDP_QUARANTINE];
+static csp_mutex_t csp_rdp_quarantine_lock;
+#endif
+
+/* Retry interval for an ACK deferred because the RX queue is full */
+#define RDP_ACK_POLL 100
 
-/* Used for queue calls */
-static CSP_BASE_TYPE pdTrue = 1;
+/* Congestion window a connection starts out with, in segments */
+#define RDP_CC_INIT_CWND 2
 
 typedef struct __attribute__((__packed__)) {
 	/* The timestamp is placed in the padding bytes */
@@ -74,7 +121,8 @@ typedef struct __attribute__((__packed__)) {
 		uint8_t flags;
 		struct __attribute__((__packed__)) {
 #if defined(CSP_BIG_ENDIAN) && !defined(CSP_LITTLE_ENDIAN)
-			unsigned int res : 4;
+			unsigned int res : 3;
+			unsigned int wnd : 1;
 			unsigned int syn : 1;
 			unsigned int ack : 1;
 			unsigned int eak : 1;
@@ -84,7 +132,8 @@ typedef struct __attribute__((__packed__)) {
 			unsigned int eak : 1;
 			unsigned int ack : 1;
 			unsigned int syn : 1;
-			unsigned int res : 4;
+			unsigned int wnd : 1;
+			unsigned int res : 3;
 #else
   #error "Must define one of CSP_BIG_ENDIAN or CSP_LITTLE_ENDIAN in csp_platform.h"
 #endif
@@ -149,6 +198,296 @@ static inline int csp_rdp_time_after(uint32_t time, uint32_t cmp) {
 	return csp_rdp_time_before(cmp, time);
 }
 
+/**
+ * TIMEOUT SCHEDULING
+ * The router only checks a connection when its deadline has passed. These helpers
+ * keep track of the earliest deadline while the connection state is examined.
+ */
+static inline void csp_rdp_deadline(uint32_t * deadline, int * set, uint32_t time) {
+	if (!*set || csp_rdp_time_before(time, *deadline)) {
+		*deadline = time;
+		*set = 1;
+	}
+}
+
+/**
+ * SEGMENT WINDOWS
+ * Unacknowledged outgoing segments are stored in tx_window at seq % CSP_RDP_MAX_WINDOW,
+ * and out of order incoming segments in rx_window at seq % (2 * CSP_RDP_MAX_WINDOW).
+ * Both windows are protected by the connection lock.
+ */
+static inline csp_packet_t ** csp_rdp_tx_slot(csp_conn_t * conn, uint16_t seq) {
+	return &conn->rdp.tx_window[seq % CSP_RDP_MAX_WINDOW];
+}
+
+static inline csp_packet_t ** csp_rdp_rx_slot(csp_conn_t * conn, uint16_t seq) {
+	return &conn->rdp.rx_window[seq % (CSP_RDP_MAX_WINDOW * 2)];
+}
+
+/**
+ * RETRANSMISSION TIMEOUT
+ * The RTO is estimated from the round trip time as described in RFC 6298, with
+ * srtt and rttvar kept in fixed point. Only segments that were sent once are
+ * sampled (Karn's rule). The RTO is doubled when the oldest segment times out,
+ * and the backoff is dropped again when an ACK advances the window.
+ */
+static uint32_t csp_rdp_rto_clamp(uint32_t rto) {
+	if (rto < csp_rdp_rto_min)
+		return csp_rdp_rto_min;
+	if (rto > csp_rdp_rto_max)
+		return csp_rdp_rto_max;
+	return rto;
+}
+
+static void csp_rdp_rtt_sample(csp_conn_t * conn, uint32_t rtt) {
+
+	if (!conn->rdp.rtt_valid) {
+		/* First measurement: SRTT = R, RTTVAR = R/2 */
+		conn->rdp.srtt = rtt << 3;
+		conn->rdp.rttvar = rtt << 1;
+		conn->rdp.rtt_valid = 1;
+	} else {
+		/* SRTT = 7/8 SRTT + 1/8 R, RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R| */
+		int32_t err = (int32_t) rtt - (int32_t) (conn->rdp.srtt >> 3);
+		conn->rdp.srtt += err;
+		if (err < 0)
+			err = -err;
+		conn->rdp.rttvar += err - (int32_t) (conn->rdp.rttvar >> 2);
+	}
+
+}
+
+/* Recompute the RTO from the current estimate, which also undoes any backoff */
+static void csp_rdp_rto_update(csp_conn_t * conn) {
+
+	/* Without a measurement, fall back to the configured packet timeout */
+	if (!conn->rdp.rtt_valid) {
+		conn->rdp.rto = csp_rdp_rto_clamp(conn->rdp.packet_timeout);
+		return;
+	}
+
+	/* RTO = SRTT + max(G, 4 * RTTVAR), with a clock granularity of 1 ms */
+	conn->rdp.rto = csp_rdp_rto_clamp((conn->rdp.srtt >> 3) + (conn->rdp.rttvar > 0 ? conn->rdp.rttvar : 1));
+
+}
+
+static void csp_rdp_rto_reset(csp_conn_t * conn) {
+	conn->rdp.rtt_valid = 0;
+	conn->rdp.srtt = 0;
+	conn->rdp.rttvar = 0;
+	csp_rdp_rto_update(conn);
+}
+
+static void csp_rdp_rto_backoff(csp_conn_t * conn) {
+	conn->rdp.rto = csp_rdp_rto_clamp(conn->rdp.rto * 2);
+}
+
+/**
+ * CONGESTION CONTROL
+ * With CSP_RDP_CC_AIMD the segments in flight are limited by cwnd as in RFC 5681:
+ * slow start up to ssthresh, then one more segment per window of ACKed segments.
+ * Loss detected from EACKs halves cwnd once per window of data, and a timeout of
+ * the oldest segment restarts from a single segment. With CSP_RDP_CC_PACING new
+ * segments are spaced by srtt / cwnd, so a window is not sent as one burst.
+ */
+static void csp_rdp_cc_reset(csp_conn_t * conn) {
+	conn->rdp.cc = csp_rdp_cc;
+	conn->rdp.cwnd = RDP_CC_INIT_CWND < conn->rdp.window_size ? RDP_CC_INIT_CWND : conn->rdp.window_size;
+	conn->rdp.ssthresh = conn->rdp.window_size;
+	conn->rdp.cwnd_acked = 0;
+	conn->rdp.tx_last = 0;
+}
+
+/* Number of segments the sender may have in flight */
+static inline uint32_t csp_rdp_send_window(csp_conn_t * conn) {
+	if ((conn->rdp.cc & CSP_RDP_CC_AIMD) && conn->rdp.cwnd < conn->rdp.window_size)
+		return conn->rdp.cwnd;
+	return conn->rdp.window_size;
+}
+
+/* Check if another segment may be sent. Segments the receiver holds out of order have
+ * left the network, so they do not count against cwnd */
+static int csp_rdp_tx_ready(csp_conn_t * conn) {
+
+	uint16_t seq, flight = conn->rdp.snd_nxt - conn->rdp.snd_una;
+
+	if (flight >= conn->rdp.window_size)
+		return 0;
+	if ((conn->rdp.options & RDP_OPT_RWND) && flight > 0
+			&& !csp_rdp_seq_between(conn->rdp.snd_nxt, conn->rdp.snd_una, conn->rdp.snd_edge))
+		return 0;
+	if (!(conn->rdp.cc & CSP_RDP_CC_AIMD))
+		return 1;
+
+	for (seq = conn->rdp.snd_una; seq != conn->rdp.snd_nxt; seq++)
+		if (*csp_rdp_tx_slot(conn, seq) == NULL)
+			flight--;
+
+	return flight < conn->rdp.cwnd;
+
+}
+
+/* Loss recovery lasts until the segments in flight at the time of the loss are ACKed */
+static inline int csp_rdp_cc_recovering(csp_conn_t * conn) {
+	return csp_rdp_seq_before(conn->rdp.snd_una, conn->rdp.recover);
+}
+
+static void csp_rdp_cc_ack(csp_conn_t * conn, uint16_t acked) {
+
+	if (csp_rdp_cc_recovering(conn))
+		return;
+
+	if (conn->rdp.cwnd < conn->rdp.ssthresh) {
+		conn->rdp.cwnd += acked;
+	} else {
+		conn->rdp.cwnd_acked += acked;
+		if (conn->rdp.cwnd_acked >= conn->rdp.cwnd) {
+			conn->rdp.cwnd_acked -= conn->rdp.cwnd;
+			conn->rdp.cwnd++;
+		}
+	}
+
+	if (conn->rdp.cwnd > conn->rdp.window_size)
+		conn->rdp.cwnd = conn->rdp.window_size;
+
+}
+
+static void csp_rdp_cc_loss(csp_conn_t * conn, int timeout) {
+
+	uint32_t flight = (uint16_t)(conn->rdp.snd_nxt - conn->rdp.snd_una);
+
+	conn->rdp.ssthresh = flight / 2 > 2 ? flight / 2 : 2;
+	conn->rdp.cwnd = timeout ? 1 : conn->rdp.ssthresh;
+	conn->rdp.cwnd_acked = 0;
+	conn->rdp.recover = conn->rdp.snd_nxt;
+
+}
+
+/* Milliseconds between new segments when pacing */
+static uint32_t csp_rdp_pacing_interval(csp_conn_t * conn) {
+	return (conn->rdp.srtt >> 3) / csp_rdp_send_window(conn);
+}
+
+static int csp_rdp_tx_window_add(csp_conn_t * conn, uint16_t seq, csp_packet_t * packet) {
+
+	int ret = CSP_ERR_NOBUFS;
+
+	csp_conn_lock(conn, CSP_MAX_DELAY);
+
+	/* The segment must fit in the window, and the slot must be free */
+	csp_packet_t ** slot = csp_rdp_tx_slot(conn, seq);
+	if ((uint16_t)(seq - conn->rdp.snd_una) < CSP_RDP_MAX_WINDOW && *slot == NULL) {
+		*slot = packet;
+		conn->rdp.tx_retries[seq % CSP_RDP_MAX_WINDOW] = 0;
+		ret = CSP_ERR_NONE;
+	}
+
+	csp_conn_unlock(conn);
+
+	return ret;
+
+}
+
+/* Store current ack'ed sequence number, free acknowledged segments and wake the TX task */
+static void csp_rdp_ack_advance(csp_conn_t * conn, uint16_t snd_una) {
+
+	/* Only move forward, and never past the next segment to send */
+	if (!csp_rdp_seq_between(snd_una, conn->rdp.snd_una + 1, conn->rdp.snd_nxt))
+		return;
+
+	uint32_t time_now = csp_get_ms();
+	uint16_t acked = snd_una - conn->rdp.snd_una;
+
+	csp_conn_lock(conn, CSP_MAX_DELAY);
+	while (conn->rdp.snd_una != snd_una) {
+		csp_packet_t ** slot = csp_rdp_tx_slot(conn, conn->rdp.snd_una);
+		if (*slot != NULL) {
+			/* Sample the RTT from the newest acknowledged segment, if it was sent once */
+			if ((uint16_t)(conn->rdp.snd_una + 1) == snd_una && conn->rdp.tx_retries[conn->rdp.snd_una % CSP_RDP_MAX_WINDOW] == 0)
+				csp_rdp_rtt_sample(conn, time_now - ((rdp_packet_t *) *slot)->timestamp);
+			csp_log_protocol("TX Element Free, seq %u\r\n", conn->rdp.snd_una);
+			csp_buffer_free(*slot);
+			*slot = NULL;
+		}
+		conn->rdp.snd_una++;
+	}
+
+	/* The link delivers again, so drop the backoff even without a valid sample */
+	csp_rdp_rto_update(conn);
+	if (conn->rdp.cc & CSP_RDP_CC_AIMD)
+		csp_rdp_cc_ack(conn, acked);
+	csp_conn_unlock(conn);
+
+	/* Timed out segments held back by cwnd are sent as ACKs arrive */
+	if ((conn->rdp.cc & CSP_RDP_CC_AIMD) && conn->rdp.snd_una != conn->rdp.snd_nxt)
+		csp_conn_schedule(conn, time_now);
+
+	/* Wake a sender waiting for the window to open right away */
+	if (conn->rdp.state == RDP_OPEN && csp_rdp_tx_ready(conn))
+		csp_bin_sem_post(&conn->rdp.tx_wait);
+
+}
+
+/**
+ * RECEIVE WINDOW
+ * If both ends support RDP_OPT_RWND, every segment that carries an ACK also carries the
+ * last sequence number the receiver has room for in its RX queue. It is a uint16_t placed
+ * just before the RDP header, and marked by the wnd flag. The sender does not send beyond
+ * it, except for a single segment when nothing is in flight, which probes a closed window.
+ * The edge never moves back, so a segment without it leaves the window as it was.
+ */
+static uint16_t csp_rdp_rcv_edge(csp_conn_t * conn) {
+
+	int32_t room = conn->rdp.window_size;
+	int prio;
+
+	for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
+		int32_t free = CSP_RX_QUEUE_LENGTH - csp_queue_size(conn->rx_queue[prio]);
+		if (free < room)
+			room = free;
+	}
+	if (room < 0)
+		room = 0;
+
+	uint16_t edge = conn->rdp.rcv_cur + room;
+	if (csp_rdp_seq_before(edge, conn->rdp.rcv_edge))
+		edge = conn->rdp.rcv_edge;
+
+	return edge;
+
+}
+
+/**
+ * Append the receive window to a segment, the RDP header is added after it.
+ * The field is left out if the segment would no longer fit the buffer or the
+ * interface MTU, so payloads sized without it are still sent.
+ * @return 1 if the field was added, 0 otherwise
+ */
+static int csp_rdp_wnd_add(csp_conn_t * conn, csp_packet_t * packet) {
+
+	/* The overhead includes the field itself once RDP_OPT_RWND is agreed */
+	size_t length = packet->length + csp_rdp_segment_overhead(conn);
+	if (length + CSP_BUFFER_PACKET_OVERHEAD > (size_t) csp_buffer_size())
+		return 0;
+	csp_route_t * ifout = csp_route_if(conn->idout.dst);
+	if (ifout != NULL && ifout->interface != NULL && ifout->interface->mtu > 0 && length > ifout->interface->mtu)
+		return 0;
+
+	uint16_t edge = csp_rdp_rcv_edge(conn);
+	uint16_t wire = csp_hton16(edge);
+
+	memcpy(&packet->data[packet->length], &wire, sizeof(wire));
+	packet->length += sizeof(wire);
+	conn->rdp.rcv_edge = edge;
+
+	/* A narrowed window is opened again by csp_rdp_check_ack */
+	if ((uint16_t)(edge - conn->rdp.rcv_cur) < conn->rdp.window_size)
+		csp_conn_schedule(conn, csp_get_ms() + RDP_ACK_POLL);
+
+	return 1;
+
+}
+
 /**
  * CONTROL MESSAGES
  * The following function is used to send empty messages,
@@ -160,14 +499,18 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 
 	/* Generate message */
 	if (!packet) {
-		packet = csp_buffer_get(20);
+		packet = csp_buffer_get_small(20);
 		if (!packet)
 			return CSP_ERR_NOMEM;
 		packet->length = 0;
 	}
 
-	/* Add RDP header */
+	/* Add RDP header, with the receive window on ACKs once the SYN exchange is over */
+	int wnd = (conn->rdp.options & RDP_OPT_RWND) && (flags & RDP_ACK) && !(flags & RDP_SYN);
+	if (wnd)
+		wnd = csp_rdp_wnd_add(conn, packet);
 	rdp_header_t * header = csp_rdp_header_add(packet);
+	header->wnd = wnd;
 	header->seq_nr = csp_hton16(seq_nr);
 	header->ack_nr = csp_hton16(ack_nr);
 	header->ack = (flags & RDP_ACK) ? 1 : 0;
@@ -175,13 +518,15 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 	header->syn = (flags & RDP_SYN) ? 1 : 0;
 	header->rst = (flags & RDP_RST) ? 1 : 0;
 
-	/* Send copy to tx_queue, before sending packet to IF */
+	/* Share packet with tx_window, before sending packet to IF */
 	if (flags & RDP_SYN) {
-		rdp_packet_t * rdp_packet = csp_buffer_clone(packet);
+		rdp_packet_t * rdp_packet = csp_buffer_ref(packet);
 		if (rdp_packet == NULL) return CSP_ERR_NOMEM;
 		rdp_packet->timestamp = csp_get_ms();
-		if (csp_queue_enqueue(conn->rdp.tx_queue, &rdp_packet, 0) != CSP_QUEUE_OK)
+		if (csp_rdp_tx_window_add(conn, seq_nr, (csp_packet_t *) rdp_packet) != CSP_ERR_NONE)
 			csp_buffer_free(rdp_packet);
+		else
+			csp_conn_schedule(conn, rdp_packet->timestamp + conn->rdp.rto);
 	}
 
 	/* Send control messages with high priority */
@@ -207,36 +552,68 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 
 /**
  * EXTENDED ACKNOWLEDGEMENTS
- * The following function sends an extended ACK packet
+ * The following function sends an extended ACK packet. The original EACK lists
+ * each segment held out of order as a uint16_t. If both ends support
+ * RDP_OPT_EACK_BITMAP, it is instead a uint16_t base sequence number followed by
+ * a bitmap, where bit i of byte i / 8 is set if segment base + i is held.
+ * Trailing zero bytes are left out.
  */
 static int csp_rdp_send_eack(csp_conn_t * conn) {
 
+	uint16_t seq, base = conn->rdp.rcv_cur + 1;
+	unsigned int i, bits = conn->rdp.window_size * 2;
+	int bitmap = conn->rdp.options & RDP_OPT_EACK_BITMAP;
+
+	/* Room for the negotiated receive window, a sequence number per segment in
+	 * the list format or a base and a bit per segment in the bitmap format. A
+	 * window too large for one buffer is only partly acknowledged */
+	int room = csp_buffer_size() - (int) CSP_BUFFER_PACKET_OVERHEAD - (int) csp_rdp_segment_overhead(conn);
+	int size = bitmap ? (int) (sizeof(uint16_t) + (bits + 7) / 8) : (int) (bits * sizeof(uint16_t));
+	if (size > room) {
+		if (room < (int) sizeof(uint16_t))
+			return CSP_ERR_NOMEM;
+		size = room;
+		if (bitmap)
+			bits = (size - sizeof(uint16_t)) * 8;
+	}
+
 	/* Allocate message */
-	csp_packet_t * packet_eack = csp_buffer_get(100);
-	if (packet_eack == NULL) return CSP_ERR_NOMEM;
+	csp_packet_t * packet_eack = csp_buffer_get_small(size);
+	if (packet_eack == NULL) {
+		csp_log_warn("No buffer for EACK\r\n");
+		return CSP_ERR_NOMEM;
+	}
 	packet_eack->length = 0;
 
-	/* Loop through RX queue */
-	int i, count;
-	csp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
+	if (bitmap) {
+		packet_eack->data16[0] = csp_hton16(base);
+		packet_eack->length = sizeof(uint16_t);
+		memset(&packet_eack->data[sizeof(uint16_t)], 0, (bits + 7) / 8);
+	}
 
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from rx_queue in queue deliver\r\n");
-			break;
-		}
+	/* Loop through RX window */
+	csp_conn_lock(conn, CSP_MAX_DELAY);
+	for (i = 0; i < bits; i++) {
 
-		/* Add seq nr to EACK packet */
-		rdp_header_t * header = csp_rdp_header_ref(packet);
-		packet_eack->data16[packet_eack->length/sizeof(uint16_t)] = csp_hton16(header->seq_nr);
-		packet_eack->length += sizeof(uint16_t);
-		csp_log_protocol("Added EACK nr %u\r\n", header->seq_nr);
+		seq = base + i;
+		csp_packet_t * packet = *csp_rdp_rx_slot(conn, seq);
+		if (packet == NULL)
+			continue;
 
-		/* Requeue */
-		csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
+		/* Add seq nr to EACK packet */
+		if (bitmap) {
+			packet_eack->data[sizeof(uint16_t) + i / 8] |= 1 << (i % 8);
+			packet_eack->length = sizeof(uint16_t) + i / 8 + 1;
+		} else {
+			if (packet_eack->length + sizeof(uint16_t) > (unsigned int) size)
+				break;
+			packet_eack->data16[packet_eack->length/sizeof(uint16_t)] = csp_hton16(seq);
+			packet_eack->length += sizeof(uint16_t);
+		}
+		csp_log_protocol("Added EACK nr %u\r\n", seq);
 
 	}
+	csp_conn_unlock(conn);
 
 	return csp_rdp_send_cmp(conn, packet_eack, RDP_ACK | RDP_EAK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 
@@ -245,12 +622,16 @@ static int csp_rdp_send_eack(csp_conn_t * conn) {
 
 /**
  * SYN Packet
- * The following function sends a SYN packet
+ * The following function sends a SYN packet, carrying the first segment for fast open
  */
-static int csp_rdp_send_syn(csp_conn_t * conn) {
+static int csp_rdp_send_syn(csp_conn_t * conn, csp_packet_t * data) {
 
 	/* Allocate message */
-	csp_packet_t * packet = csp_buffer_get(100);
+	csp_packet_t * packet;
+	if (data != NULL)
+		packet = csp_buffer_get(RDP_SYN_LENGTH + data->length);
+	else
+		packet = csp_buffer_get_small(RDP_SYN_LENGTH);
 	if (packet == NULL) return CSP_ERR_NOMEM;
 
 	/* Generate contents */
@@ -260,12 +641,32 @@ static int csp_rdp_send_syn(csp_conn_t * conn) {
 	packet->data32[3] = csp_hton32(csp_rdp_delayed_acks);
 	packet->data32[4] = csp_hton32(csp_rdp_ack_timeout);
 	packet->data32[5] = csp_hton32(csp_rdp_ack_delay_count);
-	packet->length = 6 * sizeof(uint32_t);
+	packet->data32[6] = csp_hton32(RDP_OPT_SUPPORTED);
+	packet->length = RDP_SYN_LENGTH;
+
+	if (data != NULL) {
+		memcpy(&packet->data[RDP_SYN_LENGTH], data->data, data->length);
+		packet->length += data->length;
+	}
 
 	return csp_rdp_send_cmp(conn, packet, RDP_SYN, conn->rdp.snd_iss, 0);
 
 }
 
+/* The SYN/ACK carries the agreed options, older nodes ignore the payload */
+static int csp_rdp_send_synack(csp_conn_t * conn) {
+
+	/* Allocate message */
+	csp_packet_t * packet = csp_buffer_get_small(sizeof(uint32_t));
+	if (packet == NULL) return CSP_ERR_NOMEM;
+
+	packet->data32[0] = csp_hton32(conn->rdp.options);
+	packet->length = sizeof(uint32_t);
+
+	return csp_rdp_send_cmp(conn, packet, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+
+}
+
 static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet) {
 
 	/* If a socket is set, this message is the first in a new connection
@@ -277,6 +678,7 @@ static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet)
 			csp_log_error("ERROR socket cannot accept more connections\r\n");
 			return CSP_ERR_NOBUFS;
 		}
+		csp_conn_notify(conn->listener);
 
 		/* Ensure that this connection will not be posted to this socket again
 		 * and remember that the connection handle has been passed to userspace
@@ -287,9 +689,10 @@ static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet)
 	/* Remove RDP header before passing to userspace */
 	csp_rdp_header_remove(packet);
 
-	/* Enqueue data */
+	/* Enqueue data, the packet is left as it was if there is no room */
 	if (csp_conn_enqueue_packet(conn, packet) < 0) {
 		csp_log_warn("Conn RX buffer full\r\n");
+		packet->length += sizeof(rdp_header_t);
 		return CSP_ERR_NOBUFS;
 	}
 
@@ -297,122 +700,179 @@ static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet)
 
 }
 
-static inline void csp_rdp_rx_queue_flush(csp_conn_t * conn) {
+static inline void csp_rdp_rx_window_flush(csp_conn_t * conn) {
 
-	/* Loop through RX queue */
-	int i, count;
-	csp_packet_t * packet;
+	csp_conn_lock(conn, CSP_MAX_DELAY);
+
+	/* A copy kept back by a full RX queue may have been delivered by a retransmission */
+	csp_packet_t ** held = csp_rdp_rx_slot(conn, conn->rdp.rcv_cur);
+	if (*held != NULL && csp_rdp_header_ref(*held)->seq_nr == conn->rdp.rcv_cur) {
+		csp_buffer_free(*held);
+		*held = NULL;
+	}
 
-front:
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
+	/* Deliver stored segments for as long as they are in sequence. A segment that does
+	 * not fit in the RX queue stays here, it has been EACKed and is not sent again */
+	while (1) {
+		uint16_t seq = conn->rdp.rcv_cur + 1;
+		csp_packet_t ** slot = csp_rdp_rx_slot(conn, seq);
+		csp_packet_t * packet = *slot;
+		if (packet == NULL || csp_rdp_header_ref(packet)->seq_nr != seq)
+			break;
 
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from rx_queue in queue deliver\r\n");
+		if (csp_rdp_receive_data(conn, packet) != CSP_ERR_NONE) {
+			csp_conn_schedule(conn, csp_get_ms() + RDP_ACK_POLL);
 			break;
 		}
 
-		rdp_header_t * header = csp_rdp_header_ref(packet);
-		csp_log_protocol("RX Queue deliver matching Element, seq %u\r\n", header->seq_nr);
+		csp_log_protocol("Deliver seq %u\r\n", seq);
+		*slot = NULL;
+		conn->rdp.rcv_cur = seq;
+	}
 
-		/* If the matching packet was found: */
-		if (header->seq_nr == (uint16_t)(conn->rdp.rcv_cur + 1)) {
-			csp_log_protocol("Deliver seq %u\r\n", header->seq_nr);
-			csp_rdp_receive_data(conn, packet);
-			conn->rdp.rcv_cur++;
-			/* Loop from first element again */
-			goto front;
+	csp_conn_unlock(conn);
 
-		/* Otherwise, requeue */
-		} else {
-			csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
-		}
+}
 
-	}
+static inline int csp_rdp_rx_window_add(csp_conn_t * conn, csp_packet_t * packet, uint16_t seq_nr) {
+
+	int ret = CSP_ERR_NONE;
+
+	csp_conn_lock(conn, CSP_MAX_DELAY);
+
+	/* An occupied slot means this is a duplicate */
+	csp_packet_t ** slot = csp_rdp_rx_slot(conn, seq_nr);
+	if (*slot != NULL)
+		ret = CSP_ERR_ALREADY;
+	else
+		*slot = packet;
+
+	csp_conn_unlock(conn);
+
+	return ret;
 
 }
 
-static inline bool csp_rdp_seq_in_rx_queue(csp_conn_t * conn, uint16_t seq_nr) {
+/**
+ * Send another reference of a segment in tx_window. Must be called with the connection lock held.
+ * @return CSP_ERR_NONE if the segment was sent
+ */
+static int csp_rdp_retransmit(csp_conn_t * conn, uint16_t seq, rdp_packet_t * packet) {
 
-	/* Loop through RX queue */
-	int i, count;
-	rdp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
+	/* Skip if the interface still holds the last transmission */
+	if (csp_buffer_refcount(packet) > 1)
+		return CSP_ERR_BUSY;
 
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from rx_queue in queue exists\r\n");
-			break;
-		}
+	/* Update to latest outgoing ACK and receive window */
+	rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
+	header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
+	if (header->wnd) {
+		conn->rdp.rcv_edge = csp_rdp_rcv_edge(conn);
+		uint16_t wire = csp_hton16(conn->rdp.rcv_edge);
+		memcpy((uint8_t *) header - sizeof(wire), &wire, sizeof(wire));
+	}
+
+	if (csp_send_direct(conn->idout, csp_buffer_ref(packet), 0) != CSP_ERR_NONE) {
+		csp_log_warn("Retransmission failed\r\n");
+		csp_buffer_free(packet);
+		return CSP_ERR_TX;
+	}
 
-		csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
+	/* The timestamp no longer tells when the segment was first sent */
+	uint8_t * retries = &conn->rdp.tx_retries[seq % CSP_RDP_MAX_WINDOW];
+	if (*retries < UINT8_MAX)
+		(*retries)++;
+	packet->timestamp = csp_get_ms();
 
-		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
-		csp_log_protocol("RX Queue exists matching Element, seq %u\r\n", header->seq_nr);
+	return CSP_ERR_NONE;
 
-		/* If the matching packet was found, deliver */
-		if (header->seq_nr == seq_nr) {
-			csp_log_protocol("We have a match\r\n");
-			return true;
-		}
+}
+
+/* Move the send window to a new edge from the receiver */
+static void csp_rdp_wnd_update(csp_conn_t * conn, uint16_t edge) {
+
+	if (!csp_rdp_seq_before(conn->rdp.snd_edge, edge))
+		return;
+
+	uint16_t closed = conn->rdp.snd_edge;
+	conn->rdp.snd_edge = edge;
 
+	/* A probe sent into a closed window was dropped, so send it again right away */
+	csp_conn_lock(conn, CSP_MAX_DELAY);
+	rdp_packet_t * probe = (rdp_packet_t *) *csp_rdp_tx_slot(conn, conn->rdp.snd_una);
+	if (probe != NULL && conn->rdp.snd_una != conn->rdp.snd_nxt && csp_rdp_seq_before(closed, conn->rdp.snd_una)) {
+		csp_log_protocol("RDP: Window opened, resending probe %u\r\n", conn->rdp.snd_una);
+		csp_rdp_retransmit(conn, conn->rdp.snd_una, probe);
 	}
+	csp_conn_unlock(conn);
 
-	return false;
+	if (conn->rdp.state == RDP_OPEN && csp_rdp_tx_ready(conn))
+		csp_bin_sem_post(&conn->rdp.tx_wait);
 
 }
 
-static inline int csp_rdp_rx_queue_add(csp_conn_t * conn, csp_packet_t * packet, uint16_t seq_nr) {
+/* Free a segment the receiver has stored out of order. Must be called with the connection lock held */
+static void csp_rdp_eack_free(csp_conn_t * conn, uint16_t seq) {
 
-	if (csp_rdp_seq_in_rx_queue(conn, seq_nr))
-		return CSP_QUEUE_ERROR;
-	return csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
+	if (!csp_rdp_seq_between(seq, conn->rdp.snd_una, conn->rdp.snd_nxt - 1))
+		return;
+
+	csp_packet_t ** slot = csp_rdp_tx_slot(conn, seq);
+	if (*slot != NULL) {
+		csp_log_protocol("TX Element %u freed\r\n", seq);
+		csp_buffer_free(*slot);
+		*slot = NULL;
+	}
 
 }
 
 static void csp_rdp_flush_eack(csp_conn_t * conn, csp_packet_t * eack_packet) {
 
-	/* Loop through TX queue */
-	int i, j, count;
-	rdp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.tx_queue);
-	for (i = 0; i < count; i++) {
+	unsigned int i, length = eack_packet->length - sizeof(rdp_header_t);
+	uint16_t seq;
+	unsigned int later = 0;
 
-		if (csp_queue_dequeue(conn->rdp.tx_queue, &packet, 0) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from tx_queue in flush EACK\r\n");
-			break;
-		}
+	csp_conn_lock(conn, CSP_MAX_DELAY);
 
-		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
-		csp_log_protocol("EACK compare element, time %u, seq %u\r\n", packet->timestamp, csp_ntoh16(header->seq_nr));
-
-		/* Look for this element in EACKs */
-		int match = 0;
-		for (j = 0; j < (int)((eack_packet->length - sizeof(rdp_header_t)) / sizeof(uint16_t)); j++) {
-			if (csp_ntoh16(eack_packet->data16[j]) == csp_ntoh16(header->seq_nr))
-				match = 1;
-
-			/* Enable this if you want EACK's to trigger retransmission */
-			if (csp_ntoh16(eack_packet->data16[j]) > csp_ntoh16(header->seq_nr)) {
-				uint32_t time_now = csp_get_ms();
-				if (csp_rdp_time_after(time_now, packet->quarantine)) {
-					packet->timestamp = time_now - conn->rdp.packet_timeout - 1;
-					packet->quarantine = time_now +	conn->rdp.packet_timeout / 2;
-				}
-			}
+	/* Free all segments the receiver has stored out of order */
+	if (conn->rdp.options & RDP_OPT_EACK_BITMAP) {
+		if (length >= sizeof(uint16_t)) {
+			uint16_t base = csp_ntoh16(eack_packet->data16[0]);
+			for (i = 0; i < (length - sizeof(uint16_t)) * 8; i++)
+				if (eack_packet->data[sizeof(uint16_t) + i / 8] & (1 << (i % 8)))
+					csp_rdp_eack_free(conn, base + i);
 		}
+	} else {
+		for (i = 0; i < length / sizeof(uint16_t); i++)
+			csp_rdp_eack_free(conn, csp_ntoh16(eack_packet->data16[i]));
+	}
 
-		if (match == 0) {
-			/* If not found, put back on tx queue */
-			csp_queue_enqueue(conn->rdp.tx_queue, &packet, 0);
-		} else {
-			/* Found, free */
-			csp_log_protocol("TX Element %u freed\r\n", csp_ntoh16(header->seq_nr));
-			csp_buffer_free(packet);
+	/**
+	 * FAST RETRANSMIT:
+	 * Empty slots above snd_una are segments the receiver holds out of order. A segment
+	 * with at least fast_retransmit of those after it is considered lost, and is resent
+	 * right away unless it is in quarantine from an earlier EACK.
+	 */
+	uint32_t time_now = csp_get_ms();
+	for (seq = conn->rdp.snd_nxt; conn->rdp.fast_retransmit > 0 && seq != conn->rdp.snd_una; ) {
+		seq--;
+		rdp_packet_t * packet = (rdp_packet_t *) *csp_rdp_tx_slot(conn, seq);
+		if (packet == NULL) {
+			later++;
+			continue;
+		}
+		if (later >= conn->rdp.fast_retransmit && csp_rdp_time_after(time_now, packet->quarantine)) {
+			csp_log_protocol("TX Element %u lost, retransmitting\r\n", seq);
+			if ((conn->rdp.cc & CSP_RDP_CC_AIMD) && !csp_rdp_cc_recovering(conn))
+				csp_rdp_cc_loss(conn, 0);
+			if (csp_rdp_retransmit(conn, seq, packet) == CSP_ERR_NONE)
+				conn->rdp.fast_retransmits++;
+			packet->quarantine = time_now + conn->rdp.rto / 2;
 		}
-
 	}
 
+	csp_conn_unlock(conn);
+
 }
 
 static inline bool csp_rdp_should_ack(csp_conn_t * conn) {
@@ -430,43 +890,70 @@ static inline bool csp_rdp_should_ack(csp_conn_t * conn) {
 	if (csp_rdp_seq_after(conn->rdp.rcv_cur, conn->rdp.rcv_lsa + conn->rdp.ack_delay_count))
 		return true;
 
+	/* ACK if the sender has a full window outstanding, it cannot send more until then */
+	if (!csp_rdp_seq_before(conn->rdp.rcv_cur, conn->rdp.rcv_lsa + conn->rdp.window_size))
+		return true;
+
 	return false;
 
 }
 
 void csp_rdp_flush_all(csp_conn_t * conn) {
 
-	if ((conn == NULL) || conn->rdp.tx_queue == NULL) {
+	if (conn == NULL) {
 		csp_log_error("Null pointer passed to rdp flush all\r\n");
 		return;
 	}
 
-	rdp_packet_t * packet;
+	int i;
 
-	/* Empty TX queue */
-	while (csp_queue_dequeue_isr(conn->rdp.tx_queue, &packet, &pdTrue) == CSP_QUEUE_OK) {
-		if (packet != NULL) {
-			csp_log_protocol("Flush TX Element, time %u, seq %u\r\n", packet->timestamp, csp_ntoh16(csp_rdp_header_ref((csp_packet_t *) packet)->seq_nr));
-			csp_buffer_free(packet);
+	csp_conn_lock(conn, CSP_MAX_DELAY);
+
+	/* Empty TX window */
+	for (i = 0; i < CSP_RDP_MAX_WINDOW; i++) {
+		if (conn->rdp.tx_window[i] != NULL) {
+			csp_log_protocol("Flush TX Element, seq %u\r\n", csp_ntoh16(csp_rdp_header_ref(conn->rdp.tx_window[i])->seq_nr));
+			csp_buffer_free(conn->rdp.tx_window[i]);
+			conn->rdp.tx_window[i] = NULL;
 		}
 	}
 
-	/* Empty RX queue */
-	while (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) == CSP_QUEUE_OK) {
-		if (packet != NULL) {
-			csp_log_protocol("Flush RX Element, time %u, seq %u\r\n", packet->timestamp, csp_ntoh16(csp_rdp_header_ref((csp_packet_t *) packet)->seq_nr));
-			csp_buffer_free(packet);
+	/* Drop the rest of a segment csp_rdp_recv_stream did not consume */
+	if (conn->rdp.rx_stream != NULL) {
+		csp_buffer_free(conn->rdp.rx_stream);
+		conn->rdp.rx_stream = NULL;
+	}
+
+	/* Empty RX window */
+	for (i = 0; i < CSP_RDP_MAX_WINDOW * 2; i++) {
+		if (conn->rdp.rx_window[i] != NULL) {
+			csp_log_protocol("Flush RX Element, seq %u\r\n", csp_rdp_header_ref(conn->rdp.rx_window[i])->seq_nr);
+			csp_buffer_free(conn->rdp.rx_window[i]);
+			conn->rdp.rx_window[i] = NULL;
 		}
 	}
 
+	csp_conn_unlock(conn);
+
 }
 
 int csp_rdp_check_ack(csp_conn_t * conn) {
 
+	/* Tell the sender when a narrowed receive window opens again, at once if it was
+	 * closed and otherwise when it has grown by half a window */
+	if ((conn->rdp.options & RDP_OPT_RWND) && conn->rdp.state == RDP_OPEN) {
+		uint16_t open = conn->rdp.rcv_edge - conn->rdp.rcv_cur;
+		uint16_t grown = csp_rdp_rcv_edge(conn) - conn->rdp.rcv_edge;
+		if (open < conn->rdp.window_size && grown > 0 && (open == 0 || grown >= (conn->rdp.window_size + 1) / 2)) {
+			csp_log_protocol("RDP: Receive window opened by %u\r\n", grown);
+			return csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
+		}
+	}
+
 	if (conn->rdp.rcv_lsa != conn->rdp.rcv_cur) {
-		/* Check all RX queues for spare capacity */
+		/* Check all RX queues for spare capacity, unless the receive window covers it */
 		int prio, avail = 1;
-		for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
+		for (prio = 0; !(conn->rdp.options & RDP_OPT_RWND) && prio < CSP_RX_QUEUES; prio++) {
 			if (CSP_RX_QUEUE_LENGTH - csp_queue_size(conn->rx_queue[prio]) <= (int32_t)conn->rdp.window_size) {
 				avail = 0;
 				break;
@@ -491,6 +978,8 @@ int csp_rdp_check_ack(csp_conn_t * conn) {
 void csp_rdp_check_timeouts(csp_conn_t * conn) {
 
 	rdp_packet_t * packet;
+	uint32_t deadline = 0, sent = 0;
+	int scheduled = 0, oldest = 1;
 
 	/**
 	 * CONNECTION TIMEOUT:
@@ -503,6 +992,7 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 			csp_close(conn);
 			return;
 		}
+		csp_rdp_deadline(&deadline, &scheduled, conn->timestamp + conn->rdp.conn_timeout);
 	}
 
 	/**
@@ -513,66 +1003,106 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 		if (csp_rdp_time_after(time_now, conn->timestamp + conn->rdp.conn_timeout)) {
 			csp_log_protocol("CLOSE_WAIT timeout\r\n");
 			csp_close(conn);
+		} else {
+			csp_conn_schedule(conn, conn->timestamp + conn->rdp.conn_timeout);
 		}
 		return;
 	}
 
+	/**
+	 * FAST OPEN TIMEOUT:
+	 * A client that waits for data before it sends must not wait for the SYN as well
+	 */
+	if (conn->rdp.fastopen == RDP_FO_DEFERRED) {
+		if (csp_rdp_time_after(time_now, conn->timestamp + RDP_FO_DELAY))
+			csp_rdp_send_deferred_syn(conn);
+		else
+			csp_rdp_deadline(&deadline, &scheduled, conn->timestamp + RDP_FO_DELAY);
+	}
+
 	/**
 	 * MESSAGE TIMEOUT:
 	 * Check each outgoing message for TX timeout
 	 */
-	int i, count;
-	count = csp_queue_size(conn->rdp.tx_queue);
-	for (i = 0; i < count; i++) {
+	uint16_t seq;
+	csp_conn_lock(conn, CSP_MAX_DELAY);
+	for (seq = conn->rdp.snd_una; seq != conn->rdp.snd_nxt; seq++) {
 
-		if ((csp_queue_dequeue_isr(conn->rdp.tx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) || packet == NULL) {
-			csp_log_warn("Cannot dequeue from tx_queue in check timeout\r\n");
-			break;
-		}
-
-		/* Get header */
-		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
-
-		/* If acked, do not retransmit */
-		if (csp_rdp_seq_before(csp_ntoh16(header->seq_nr), conn->rdp.snd_una)) {
-			csp_log_protocol("TX Element Free, time %u, seq %u, una %u\r\n", packet->timestamp, csp_ntoh16(header->seq_nr), conn->rdp.snd_una);
-			csp_buffer_free(packet);
+		packet = (rdp_packet_t *) *csp_rdp_tx_slot(conn, seq);
+		if (packet == NULL)
 			continue;
-		}
 
 		/* Check timestamp and retransmit if needed */
-		if (csp_rdp_time_after(time_now, packet->timestamp + conn->rdp.packet_timeout)) {
-			csp_log_protocol("TX Element timed out, retransmitting seq %u\r\n", csp_ntoh16(header->seq_nr));
-
-			/* Update to latest outgoing ACK */
-			header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
-
-			/* Send copy to tx_queue */
-			packet->timestamp = csp_get_ms();
-			csp_packet_t * new_packet = csp_buffer_clone(packet);
-			if (csp_send_direct(conn->idout, new_packet, 0) != CSP_ERR_NONE) {
-				csp_log_warn("Retransmission failed\r\n");
-				csp_buffer_free(new_packet);
+		if (csp_rdp_time_after(time_now, packet->timestamp + conn->rdp.rto)) {
+
+			/* The interface still holds the last transmission, so it is not lost yet */
+			if (csp_buffer_refcount(packet) > 1) {
+				csp_rdp_deadline(&deadline, &scheduled, time_now + RDP_ACK_POLL);
+				oldest = 0;
+				continue;
+			}
+
+			/* Back off when the oldest segment times out, not once per segment. During
+			 * recovery, only a lost retransmission counts as another timeout */
+			if (oldest && (!(conn->rdp.cc & CSP_RDP_CC_AIMD) || !csp_rdp_cc_recovering(conn)
+					|| conn->rdp.tx_retries[seq % CSP_RDP_MAX_WINDOW] > 0)) {
+				csp_rdp_rto_backoff(conn);
+				if (conn->rdp.cc & CSP_RDP_CC_AIMD)
+					csp_rdp_cc_loss(conn, 1);
+			}
+
+			/* Hold back what does not fit in cwnd until ACKs arrive */
+			if ((conn->rdp.cc & CSP_RDP_CC_AIMD) && sent >= conn->rdp.cwnd) {
+				csp_rdp_deadline(&deadline, &scheduled, time_now + RDP_ACK_POLL);
+				oldest = 0;
+				continue;
+			}
+
+			csp_log_protocol("TX Element timed out, retransmitting seq %u\r\n", seq);
+			sent++;
+			if (csp_rdp_retransmit(conn, seq, packet) == CSP_ERR_NONE) {
+				conn->rdp.timeout_retransmits++;
+			} else {
+				/* The timestamp was kept, so try again shortly */
+				csp_rdp_deadline(&deadline, &scheduled, time_now + RDP_ACK_POLL);
+				oldest = 0;
+				continue;
 			}
 
 		}
 
-		/* Requeue the TX element */
-		csp_queue_enqueue_isr(conn->rdp.tx_queue, &packet, &pdTrue);
+		csp_rdp_deadline(&deadline, &scheduled, packet->timestamp + conn->rdp.rto);
+		oldest = 0;
 
 	}
+	csp_conn_unlock(conn);
+
+	/* Retry segments kept back by a full RX queue */
+	csp_rdp_rx_window_flush(conn);
 
 	/**
 	 * ACK TIMEOUT:
 	 * Check ACK timeouts, if we have unacknowledged segments
 	 */
 	csp_rdp_check_ack(conn);
+	if (conn->rdp.rcv_lsa != conn->rdp.rcv_cur) {
+		uint32_t ack_deadline = conn->rdp.ack_timestamp + conn->rdp.ack_timeout;
+		if (!csp_rdp_time_after(ack_deadline, time_now))
+			ack_deadline = time_now + RDP_ACK_POLL;
+		csp_rdp_deadline(&deadline, &scheduled, ack_deadline);
+	}
+
+	/* Watch a narrowed receive window until it opens */
+	if ((conn->rdp.options & RDP_OPT_RWND) && (uint16_t)(conn->rdp.rcv_edge - conn->rdp.rcv_cur) < conn->rdp.window_size)
+		csp_rdp_deadline(&deadline, &scheduled, time_now + RDP_ACK_POLL);
+
+	if (scheduled)
+		csp_conn_schedule(conn, deadline);
 
-	/* Wake user task if TX queue is ready for more data */
+	/* Wake user task if TX window is ready for more data */
 	if (conn->rdp.state == RDP_OPEN)
-		if (csp_queue_size(conn->rdp.tx_queue) < (int)conn->rdp.window_size)
-			if (csp_rdp_seq_before(conn->rdp.snd_nxt - conn->rdp.snd_una, conn->rdp.window_size * 2))
-				csp_bin_sem_post(&conn->rdp.tx_wait);
+		if (csp_rdp_tx_ready(conn))
+			csp_bin_sem_post(&conn->rdp.tx_wait);
 
 }
 
@@ -583,6 +1113,20 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 	rx_header->ack_nr = csp_ntoh16(rx_header->ack_nr);
 	rx_header->seq_nr = csp_ntoh16(rx_header->seq_nr);
 
+	/* Take out the receive window, so the RDP header is last in the packet again */
+	if (rx_header->wnd) {
+		uint16_t edge;
+		if (packet->length < sizeof(rdp_header_t) + sizeof(edge))
+			goto discard_open;
+		uint8_t * field = (uint8_t *) rx_header - sizeof(edge);
+		memcpy(&edge, field, sizeof(edge));
+		memmove(field, rx_header, sizeof(rdp_header_t));
+		packet->length -= sizeof(edge);
+		rx_header = csp_rdp_header_ref(packet);
+		if (rx_header->ack && (conn->rdp.options & RDP_OPT_RWND))
+			csp_rdp_wnd_update(conn, csp_ntoh16(edge));
+	}
+
 	csp_log_protocol("RDP: Received in S %u: syn %u, ack %u, eack %u, "
 			"rst %u, seq_nr %5u, ack_nr %5u, packet_len %u (%u)\r\n",
 			conn->rdp.state, rx_header->syn, rx_header->ack, rx_header->eak,
@@ -594,7 +1138,14 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 		if (rx_header->ack) {
 			/* Store current ack'ed sequence number */
-			conn->rdp.snd_una = rx_header->ack_nr + 1;
+			csp_rdp_ack_advance(conn, rx_header->ack_nr + 1);
+		}
+
+		/* A repeated RST from the other end must not close the connection under
+		 * userspace, which may not have read the last segments yet */
+		if (conn->rdp.state == RDP_CLOSE_WAIT && conn->rdp.peer_reset) {
+			csp_log_protocol("RST received in CLOSE_WAIT, already reset by the other end\r\n");
+			goto discard_open;
 		}
 
 		if (conn->rdp.state == RDP_CLOSE_WAIT || conn->rdp.state == RDP_CLOSED) {
@@ -608,7 +1159,9 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			if (rx_header->seq_nr == (uint16_t)(conn->rdp.rcv_cur + 1)) {
 				csp_log_protocol("RESET in sequence, no more data incoming, reply with RESET\r\n");
 				conn->rdp.state = RDP_CLOSE_WAIT;
+				conn->rdp.peer_reset = 1;
 				conn->timestamp = csp_get_ms();
+				csp_conn_schedule(conn, conn->timestamp + conn->rdp.conn_timeout);
 				csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_RST, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 				goto discard_close;
 			} else {
@@ -636,10 +1189,10 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		csp_log_protocol("RDP: SYN-Received\r\n");
 
 		/* Setup TX seq. */
-		srand(csp_get_ms());
 		conn->rdp.snd_iss = (uint16_t)rand();
 		conn->rdp.snd_nxt = conn->rdp.snd_iss + 1;
 		conn->rdp.snd_una = conn->rdp.snd_iss;
+		conn->rdp.recover = conn->rdp.snd_iss;
 
 		/* Store RX seq. */
 		conn->rdp.rcv_cur = rx_header->seq_nr;
@@ -653,6 +1206,24 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		conn->rdp.delayed_acks 		= csp_ntoh32(packet->data32[3]);
 		conn->rdp.ack_timeout 		= csp_ntoh32(packet->data32[4]);
 		conn->rdp.ack_delay_count 	= csp_ntoh32(packet->data32[5]);
+		conn->rdp.fast_retransmit	= csp_rdp_fast_retransmit;
+
+		/* Older nodes send six words and support no options */
+		conn->rdp.options = 0;
+		if (packet->length >= sizeof(rdp_header_t) + RDP_SYN_LENGTH)
+			conn->rdp.options = csp_ntoh32(packet->data32[6]) & RDP_OPT_SUPPORTED;
+		conn->rdp.fast_retransmits	= 0;
+		conn->rdp.timeout_retransmits = 0;
+		csp_rdp_rto_reset(conn);
+
+		/* The windows are only allocated for CSP_RDP_MAX_WINDOW segments */
+		if (conn->rdp.window_size > CSP_RDP_MAX_WINDOW)
+			conn->rdp.window_size = CSP_RDP_MAX_WINDOW;
+		csp_rdp_cc_reset(conn);
+
+		/* Both receive windows start out a full window wide */
+		conn->rdp.snd_edge = conn->rdp.snd_iss + conn->rdp.window_size;
+		conn->rdp.rcv_edge = conn->rdp.rcv_irs + conn->rdp.window_size;
 		csp_log_protocol("RDP: Window Size %u, conn timeout %u, packet timeout %u\r\n",
 				conn->rdp.window_size, conn->rdp.conn_timeout, conn->rdp.packet_timeout);
 		csp_log_protocol("RDP: Delayed acks: %u, ack timeout %u, ack each %u packet\r\n",
@@ -661,9 +1232,33 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		/* Connection accepted */
 		conn->rdp.state = RDP_SYN_RCVD;
 
+		/* Close the connection if it is never accepted */
+		if (conn->socket != NULL)
+			csp_conn_schedule(conn, conn->timestamp + conn->rdp.conn_timeout);
+
+		/* Fast open: data after the parameters is delivered along with the connection.
+		 * It is queued before the SYN/ACK, so the SYN/ACK only acknowledges data that
+		 * was delivered. Data that cannot be queued is refused by leaving the option
+		 * out of the SYN/ACK, and the client sends it again once the connection is open */
+		int delivered = 0;
+		conn->rdp.fastopen = RDP_FO_NONE;
+		if ((conn->rdp.options & RDP_OPT_FASTOPEN) && packet->length > sizeof(rdp_header_t) + RDP_SYN_LENGTH) {
+			csp_log_protocol("RDP: Fast open, %u bytes with SYN\r\n", packet->length - sizeof(rdp_header_t) - RDP_SYN_LENGTH);
+			packet->length -= RDP_SYN_LENGTH;
+			memmove(packet->data, &packet->data[RDP_SYN_LENGTH], packet->length);
+			if (csp_rdp_receive_data(conn, packet) == CSP_ERR_NONE) {
+				delivered = 1;
+			} else {
+				csp_log_warn("RDP: Fast open data not queued, acknowledging SYN only\r\n");
+				conn->rdp.options &= ~RDP_OPT_FASTOPEN;
+			}
+		}
+
 		/* Send SYN/ACK */
-		csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+		csp_rdp_send_synack(conn);
 
+		if (delivered)
+			goto accepted_open;
 		goto discard_open;
 
 	}
@@ -680,12 +1275,37 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			conn->rdp.rcv_cur = rx_header->seq_nr;
 			conn->rdp.rcv_irs = rx_header->seq_nr;
 			conn->rdp.rcv_lsa = rx_header->seq_nr - 1;
-			conn->rdp.snd_una = rx_header->ack_nr + 1;
+			conn->rdp.rcv_edge = conn->rdp.rcv_irs + conn->rdp.window_size;
+
+			/* Options agreed by the server, none if it is an older node */
+			conn->rdp.options = 0;
+			if (packet->length >= sizeof(rdp_header_t) + sizeof(uint32_t))
+				conn->rdp.options = csp_ntoh32(packet->data32[0]) & RDP_OPT_SUPPORTED;
+			csp_rdp_peer_options[conn->idout.dst] = conn->rdp.options;
+
+			/* A peer that no longer takes data on the SYN gets it again as the first segment */
+			csp_packet_t * resend = NULL;
+			if (conn->rdp.fastopen == RDP_FO_SENT && !(conn->rdp.options & RDP_OPT_FASTOPEN)) {
+				csp_packet_t * syn = *csp_rdp_tx_slot(conn, conn->rdp.snd_iss);
+				if (syn != NULL && (resend = csp_buffer_clone(syn)) != NULL) {
+					resend->length -= RDP_SYN_LENGTH + sizeof(rdp_header_t);
+					memmove(resend->data, &resend->data[RDP_SYN_LENGTH], resend->length);
+				}
+			}
+			conn->rdp.fastopen = RDP_FO_NONE;
+
+			csp_rdp_ack_advance(conn, rx_header->ack_nr + 1);
 			conn->rdp.ack_timestamp = csp_get_ms();
 			conn->rdp.state = RDP_OPEN;
 
 			csp_log_protocol("RDP: NP: Connection OPEN\r\n");
 
+			if (resend != NULL) {
+				csp_log_warn("RDP: Fast open data ignored by peer, resending\r\n");
+				if (csp_rdp_send(conn, resend, 0) != CSP_ERR_NONE || csp_send_direct(conn->idout, resend, 0) != CSP_ERR_NONE)
+					csp_buffer_free(resend);
+			}
+
 			/* Send ACK */
 			if (conn->rdp.delayed_acks == 0)
 				csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
@@ -696,6 +1316,29 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			goto discard_open;
 		}
 
+		/* A fast open server may send data that acknowledges our SYN before its SYN/ACK arrives */
+		if (rx_header->ack && conn->rdp.fastopen == RDP_FO_SENT) {
+			if (rx_header->ack_nr != conn->rdp.snd_iss) {
+				csp_log_protocol("RDP: Segment before SYN/ACK, discarding\r\n");
+				goto discard_open;
+			}
+
+			conn->rdp.rcv_irs = rx_header->seq_nr - 1;
+			conn->rdp.rcv_cur = conn->rdp.rcv_irs;
+			conn->rdp.rcv_lsa = conn->rdp.rcv_irs - 1;
+			conn->rdp.rcv_edge = conn->rdp.rcv_irs + conn->rdp.window_size;
+			conn->rdp.fastopen = RDP_FO_NONE;
+			conn->rdp.ack_timestamp = csp_get_ms();
+			conn->rdp.state = RDP_OPEN;
+
+			csp_log_protocol("RDP: NP: Connection OPEN, SYN/ACK implied\r\n");
+
+			/* Wake TX task */
+			csp_bin_sem_post(&conn->rdp.tx_wait);
+
+			goto implied_open;
+		}
+
 		/* If there was no SYN in the reply, our SYN message hit an already open connection
 		 * This is handled by sending a RST.
 		 * Normally this would be followed up by a new connection attempt, however
@@ -724,6 +1367,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 	 */
 	case RDP_SYN_RCVD:
 	case RDP_OPEN:
+	implied_open:
 	{
 
 		/* SYN or !ACK is invalid */
@@ -743,7 +1387,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 					rx_header->seq_nr, conn->rdp.rcv_cur + 1, conn->rdp.rcv_cur + 1 + conn->rdp.window_size * 2);
 			/* If duplicate SYN received, send another SYN/ACK */
 			if (conn->rdp.state == RDP_SYN_RCVD)
-				csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+				csp_rdp_send_synack(conn);
 			/* If duplicate data packet received, send EACK back */
 			if (conn->rdp.state == RDP_OPEN)
 				csp_rdp_send_eack(conn);
@@ -760,7 +1404,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 		/* Check SYN_RCVD ACK */
 		if (conn->rdp.state == RDP_SYN_RCVD) {
-			if (rx_header->ack_nr != conn->rdp.snd_iss) {
+			if (!csp_rdp_seq_between(rx_header->ack_nr, conn->rdp.snd_iss, conn->rdp.snd_nxt - 1)) {
 				csp_log_error("SYN-RCVD: Wrong ACK number\r\n");
 				goto discard_close;
 			}
@@ -769,7 +1413,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		}
 
 		/* Store current ack'ed sequence number */
-		conn->rdp.snd_una = rx_header->ack_nr + 1;
+		csp_rdp_ack_advance(conn, rx_header->ack_nr + 1);
 
 		/* We have an EACK */
 		if (rx_header->eak) {
@@ -784,7 +1428,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 		/* If message is not in sequence, send EACK and store packet */
 		if (rx_header->seq_nr != (uint16_t)(conn->rdp.rcv_cur + 1)) {
-			if (csp_rdp_rx_queue_add(conn, packet, rx_header->seq_nr) != CSP_QUEUE_OK) {
+			if (csp_rdp_rx_window_add(conn, packet, rx_header->seq_nr) != CSP_ERR_NONE) {
 				csp_log_protocol("Duplicate sequence number\r\n");
 				goto discard_open;
 			}
@@ -795,9 +1439,16 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		/* Store sequence number before stripping RDP header */
 		uint16_t seq_nr = rx_header->seq_nr;
 
-		/* Receive data */
-		if (csp_rdp_receive_data(conn, packet) != CSP_ERR_NONE)
-			goto discard_open;
+		/* Receive data. A segment that does not fit in the RX queue, such as a probe of a
+		 * closed window, is stored and EACKed like one out of sequence, instead of being
+		 * dropped and sent again */
+		if (csp_rdp_receive_data(conn, packet) != CSP_ERR_NONE) {
+			if (csp_rdp_rx_window_add(conn, packet, seq_nr) != CSP_ERR_NONE)
+				goto discard_open;
+			csp_rdp_send_eack(conn);
+			csp_conn_schedule(conn, csp_get_ms() + RDP_ACK_POLL);
+			goto accepted_open;
+		}
 
 		/* Update last received packet */
 		conn->rdp.rcv_cur = seq_nr;
@@ -808,16 +1459,21 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 		/* Only ACK the message if there is room for a full window in the RX buffer.
 		 * Unacknowledged segments are ACKed by csp_rdp_check_timeouts when the buffer is
-		 * no longer full. */
-		if (rx_queue_size + conn->rdp.window_size <= CSP_RX_QUEUE_LENGTH) {
+		 * no longer full. With a receive window, the ACK narrows it instead. */
+		if ((conn->rdp.options & RDP_OPT_RWND) || rx_queue_size + conn->rdp.window_size <= CSP_RX_QUEUE_LENGTH) {
 			if (csp_rdp_should_ack(conn))
 				csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 		} else {
 			csp_log_protocol("Less than one window free in RX_queue, deferring acknowledgment for %"PRIu16"\r\n", conn->rdp.rcv_cur);
 		}
 
-		/* Flush RX queue */
-		csp_rdp_rx_queue_flush(conn);
+		/* The reader may have taken the segment before rcv_cur was updated, too early
+		 * for its csp_rdp_check_ack to see the receive window open again */
+		if (conn->rdp.options & RDP_OPT_RWND)
+			csp_rdp_check_ack(conn);
+
+		/* Deliver segments stored out of order that are now in sequence */
+		csp_rdp_rx_window_flush(conn);
 
 		goto accepted_open;
 
@@ -840,7 +1496,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		}
 
 		/* Store current ack'ed sequence number */
-		conn->rdp.snd_una = rx_header->ack_nr + 1;
+		csp_rdp_ack_advance(conn, rx_header->ack_nr + 1);
 
 		/* Send back a reset */
 		csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_RST, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
@@ -865,6 +1521,9 @@ discard_close:
 discard_open:
 	csp_buffer_free(packet);
 accepted_open:
+	/* Make sure a delayed ACK is sent in time */
+	if (conn->rdp.rcv_lsa != conn->rdp.rcv_cur)
+		csp_conn_schedule(conn, conn->rdp.ack_timestamp + conn->rdp.ack_timeout);
 	return;
 
 }
@@ -873,13 +1532,20 @@ int csp_rdp_connect(csp_conn_t * conn, uint32_t timeout) {
 
 	int retry = 1;
 
-	conn->rdp.window_size	 = csp_rdp_window_size;
+	conn->rdp.window_size	 = csp_rdp_window_size < CSP_RDP_MAX_WINDOW ? csp_rdp_window_size : CSP_RDP_MAX_WINDOW;
 	conn->rdp.conn_timeout	= csp_rdp_conn_timeout;
 	conn->rdp.packet_timeout  = csp_rdp_packet_timeout;
 	conn->rdp.delayed_acks	= csp_rdp_delayed_acks;
 	conn->rdp.ack_timeout 	  = csp_rdp_ack_timeout;
 	conn->rdp.ack_delay_count = csp_rdp_ack_delay_count;
 	conn->rdp.ack_timestamp   = csp_get_ms();
+	conn->rdp.options		  = 0;
+	conn->rdp.fastopen		  = RDP_FO_NONE;
+	conn->rdp.fast_retransmit = csp_rdp_fast_retransmit;
+	conn->rdp.fast_retransmits = 0;
+	conn->rdp.timeout_retransmits = 0;
+	csp_rdp_rto_reset(conn);
+	csp_rdp_cc_reset(conn);
 
 retry:
 	csp_log_protocol("RDP: Active connect, conn state %u\r\n", conn->rdp.state);
@@ -889,21 +1555,35 @@ retry:
 		return CSP_ERR_ALREADY;
 	}
 
-	/* Randomize ISS */
-	srand(csp_get_ms());
+	/* Randomize ISS. The generator is seeded once in csp_conn_init, reseeding here
+	 * gives every connection opened in the same ms the same ISS, so late segments
+	 * of an earlier connection on the same ports look valid */
 	conn->rdp.snd_iss = (uint16_t)rand();
 
 	conn->rdp.snd_nxt = conn->rdp.snd_iss + 1;
 	conn->rdp.snd_una = conn->rdp.snd_iss;
+	conn->rdp.recover = conn->rdp.snd_iss;
+	conn->rdp.snd_edge = conn->rdp.snd_iss + conn->rdp.window_size;
 
 	csp_log_protocol("RDP: AC: Sending SYN\r\n");
 
 	/* Ensure semaphore is busy, so router task can release it */
 	csp_bin_sem_wait(&conn->rdp.tx_wait, 0);
 
+	/* With fast open to a peer known to support it, the SYN waits for the first segment,
+	 * and the options agreed last time are used right away */
+	if ((conn->opts & CSP_O_RDPFASTOPEN) && (csp_rdp_peer_options[conn->idout.dst] & RDP_OPT_FASTOPEN)) {
+		csp_log_protocol("RDP: AC: Fast open, SYN deferred to first segment\r\n");
+		conn->rdp.options = csp_rdp_peer_options[conn->idout.dst];
+		conn->rdp.fastopen = RDP_FO_DEFERRED;
+		conn->rdp.state = RDP_SYN_SENT;
+		csp_conn_schedule(conn, conn->timestamp + RDP_FO_DELAY);
+		return CSP_ERR_NONE;
+	}
+
 	/* Send SYN message */
 	conn->rdp.state = RDP_SYN_SENT;
-	if (csp_rdp_send_syn(conn) != CSP_ERR_NONE)
+	if (csp_rdp_send_syn(conn, NULL) != CSP_ERR_NONE)
 		goto error;
 
 	/* Wait for router task to release semaphore */
@@ -938,42 +1618,77 @@ error:
 
 int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
-	if (conn->rdp.state != RDP_OPEN) {
+	uint32_t start = csp_get_ms();
+
+	/* A fast open connection is handed out before the SYN/ACK arrives, so wait for it */
+	while (conn->rdp.state == RDP_SYN_SENT) {
+		uint32_t waited = csp_get_ms() - start;
+		if (waited >= timeout || csp_bin_sem_wait(&conn->rdp.tx_wait, timeout - waited) != CSP_SEMAPHORE_OK) {
+			csp_log_error("Timeout waiting for SYN/ACK\r\n");
+			return CSP_ERR_TIMEDOUT;
+		}
+	}
+
+	/* The server of a fast open connection may send as soon as it has the SYN */
+	if (conn->rdp.state != RDP_OPEN && conn->rdp.state != RDP_SYN_RCVD) {
 		csp_log_error("RDP: ERROR cannot send, connection reset by peer!\r\n");
 		return CSP_ERR_RESET;
 	}
 
-	/* If TX window is full, wait here */
-	uint16_t in_flight = conn->rdp.snd_nxt - conn->rdp.snd_una + 1;
-	if (in_flight > conn->rdp.window_size) {
+	/* If TX window is full, wait here. The stale wakeup is cleared before the window
+	 * is checked again, so an ACK arriving in between is not missed */
+	if (!csp_rdp_tx_ready(conn)) {
 		csp_log_protocol("RDP: Waiting for window update before sending seq %u\r\n", conn->rdp.snd_nxt);
 		csp_bin_sem_wait(&conn->rdp.tx_wait, 0);
-		if ((csp_bin_sem_wait(&conn->rdp.tx_wait, timeout)) != CSP_SEMAPHORE_OK) {
-			csp_log_error("Timeout during send\r\n");
-			return CSP_ERR_TIMEDOUT;
+		while (!csp_rdp_tx_ready(conn)) {
+			uint32_t waited = csp_get_ms() - start;
+			if (waited >= timeout || csp_bin_sem_wait(&conn->rdp.tx_wait, timeout - waited) != CSP_SEMAPHORE_OK) {
+				csp_log_error("Timeout during send\r\n");
+				return CSP_ERR_TIMEDOUT;
+			}
+			if (conn->rdp.state != RDP_OPEN && conn->rdp.state != RDP_SYN_RCVD) {
+				csp_log_error("RDP: ERROR cannot send, connection reset by peer!\r\n");
+				return CSP_ERR_RESET;
+			}
 		}
 	}
 
+	/* Wait out the pacing interval, as far as the timeout allows */
+	if (conn->rdp.cc & CSP_RDP_CC_PACING) {
+		uint32_t now = csp_get_ms();
+		uint32_t next = conn->rdp.tx_last + csp_rdp_pacing_interval(conn);
+		if (csp_rdp_time_after(next, now) && now - start < timeout) {
+			uint32_t wait = next - now;
+			if (wait > timeout - (now - start))
+				wait = timeout - (now - start);
+			csp_sleep_ms(wait);
+		}
+		conn->rdp.tx_last = csp_get_ms();
+	}
+
 	/* Add RDP header */
+	int wnd = 0;
+	if (conn->rdp.options & RDP_OPT_RWND)
+		wnd = csp_rdp_wnd_add(conn, packet);
 	rdp_header_t * tx_header = csp_rdp_header_add(packet);
+	tx_header->wnd = wnd;
 	tx_header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
 	tx_header->seq_nr = csp_hton16(conn->rdp.snd_nxt);
 	tx_header->ack = 1;
 
-	/* Send copy to tx_queue */
-	rdp_packet_t * rdp_packet = csp_buffer_clone(packet);
-	if (rdp_packet == NULL) {
-		csp_log_error("Failed to allocate packet buffer\r\n");
+	/* Share packet with tx_window, the interface releases its own reference */
+	rdp_packet_t * rdp_packet = csp_buffer_ref(packet);
+	if (rdp_packet == NULL)
 		return CSP_ERR_NOMEM;
-	}
 
 	rdp_packet->timestamp = csp_get_ms();
 	rdp_packet->quarantine = 0;
-	if (csp_queue_enqueue(conn->rdp.tx_queue, &rdp_packet, 0) != CSP_QUEUE_OK) {
+	if (csp_rdp_tx_window_add(conn, conn->rdp.snd_nxt, (csp_packet_t *) rdp_packet) != CSP_ERR_NONE) {
 		csp_log_error("No more space in RDP retransmit queue\r\n");
 		csp_buffer_free(rdp_packet);
 		return CSP_ERR_NOBUFS;
 	}
+	csp_conn_schedule(conn, rdp_packet->timestamp + conn->rdp.rto);
 
 	csp_log_protocol("RDP: Sending  in S %u: syn %u, ack %u, eack %u, "
 				"rst %u, seq_nr %5u, ack_nr %5u, packet_len %u (%u)\r\n",
@@ -986,14 +1701,145 @@ int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
 }
 
+/* Bytes added to each segment after the payload, from the RDP header and trailers */
+size_t csp_rdp_segment_overhead(csp_conn_t * conn) {
+
+	size_t overhead = sizeof(rdp_header_t);
+
+	if (conn->rdp.options & RDP_OPT_RWND)
+		overhead += sizeof(uint16_t);
+	if (conn->idout.flags & CSP_FHMAC)
+		overhead += CSP_HMAC_LENGTH;
+	if (conn->idout.flags & CSP_FCRC32)
+		overhead += sizeof(uint32_t);
+	if (conn->idout.flags & CSP_FXTEA)
+		overhead += sizeof(uint32_t);
+
+	return overhead;
+
+}
+
+/* Take over a deferred SYN, so only one of the application and the router task sends it */
+static int csp_rdp_fastopen_take(csp_conn_t * conn) {
+
+	int deferred;
+
+	csp_conn_lock(conn, CSP_MAX_DELAY);
+	deferred = (conn->rdp.fastopen == RDP_FO_DEFERRED);
+	if (deferred)
+		conn->rdp.fastopen = RDP_FO_NONE;
+	csp_conn_unlock(conn);
+
+	return deferred;
+
+}
+
+void csp_rdp_send_deferred_syn(csp_conn_t * conn) {
+
+	if (conn->rdp.fastopen != RDP_FO_DEFERRED || !csp_rdp_fastopen_take(conn))
+		return;
+
+	csp_log_protocol("RDP: Fast open, no segment to send, sending plain SYN\r\n");
+	csp_rdp_send_syn(conn, NULL);
+
+}
+
+int csp_rdp_send_fastopen(csp_conn_t * conn, csp_packet_t * packet) {
+
+	if (conn->rdp.fastopen != RDP_FO_DEFERRED || !csp_rdp_fastopen_take(conn))
+		return CSP_ERR_AGAIN;
+
+	/* The data must fit in one buffer and the MTU along with the SYN parameters */
+	size_t length = RDP_SYN_LENGTH + packet->length + csp_rdp_segment_overhead(conn);
+	csp_route_t * ifout = csp_route_if(conn->idout.dst);
+	int fits = length + CSP_BUFFER_PACKET_OVERHEAD <= (size_t) csp_buffer_size();
+	if (ifout != NULL && ifout->interface != NULL && ifout->interface->mtu > 0 && length > ifout->interface->mtu)
+		fits = 0;
+
+	if (fits) {
+		/* The SYN/ACK may arrive before csp_rdp_send_syn returns */
+		conn->rdp.fastopen = RDP_FO_SENT;
+		/* The SYN stays in tx_window until it is acknowledged, so the packet is no longer needed */
+		if (csp_rdp_send_syn(conn, packet) != CSP_ERR_NOMEM) {
+			csp_buffer_free(packet);
+			return CSP_ERR_NONE;
+		}
+	}
+
+	/* Otherwise send a plain SYN, and the segment once the connection is open */
+	conn->rdp.fastopen = RDP_FO_NONE;
+	csp_rdp_send_syn(conn, NULL);
+	return CSP_ERR_AGAIN;
+
+}
+
+int csp_rdp_send_stream(csp_conn_t * conn, const void * buf, size_t len, uint32_t timeout) {
+
+	if (conn == NULL || (buf == NULL && len > 0) || !(conn->idout.flags & CSP_FRDP))
+		return CSP_ERR_INVAL;
+
+	csp_iovec_t iov = {buf, len};
+	return csp_sendv(conn, &iov, 1, timeout);
+
+}
+
+int csp_rdp_recv_stream(csp_conn_t * conn, void * buf, size_t len, uint32_t timeout) {
+
+	uint8_t * data = buf;
+	size_t received = 0;
+
+	if (conn == NULL || (buf == NULL && len > 0) || !(conn->idin.flags & CSP_FRDP))
+		return CSP_ERR_INVAL;
+
+	while (received < len) {
+
+		/* Continue with what is left of the last segment */
+		csp_conn_lock(conn, CSP_MAX_DELAY);
+		csp_packet_t * packet = conn->rdp.rx_stream;
+		uint16_t offset = conn->rdp.rx_stream_offset;
+		conn->rdp.rx_stream = NULL;
+		csp_conn_unlock(conn);
+
+		if (packet == NULL) {
+			packet = csp_read(conn, timeout);
+			if (packet == NULL)
+				break;
+			offset = 0;
+		}
+
+		size_t chunk = packet->length - offset;
+		if (chunk > len - received)
+			chunk = len - received;
+		memcpy(&data[received], &packet->data[offset], chunk);
+		received += chunk;
+		offset += chunk;
+
+		if (offset < packet->length) {
+			csp_conn_lock(conn, CSP_MAX_DELAY);
+			conn->rdp.rx_stream = packet;
+			conn->rdp.rx_stream_offset = offset;
+			csp_conn_unlock(conn);
+			/* The rest is ready for the next call, as csp_poll reports */
+			csp_conn_notify(conn);
+		} else {
+			csp_buffer_free(packet);
+		}
+
+	}
+
+	return received;
+
+}
+
 int csp_rdp_allocate(csp_conn_t * conn) {
 
-	csp_log_buffer("RDP: Creating RDP queues for conn %p\r\n", conn);
+	csp_log_buffer("RDP: Initialising RDP state for conn %p\r\n", conn);
 
 	/* Set initial state */
 	conn->rdp.state = RDP_CLOSED;
 	conn->rdp.conn_timeout = csp_rdp_conn_timeout;
 	conn->rdp.packet_timeout = csp_rdp_packet_timeout;
+	csp_rdp_rto_reset(conn);
 
 	/* Create a binary semaphore to wait on for tasks */
 	if (csp_bin_sem_create(&conn->rdp.tx_wait) != CSP_SEMAPHORE_OK) {
@@ -1001,27 +1847,153 @@ int csp_rdp_allocate(csp_conn_t * conn) {
 		return CSP_ERR_NOMEM;
 	}
 
-	/* Create TX queue */
-	conn->rdp.tx_queue = csp_queue_create(CSP_RDP_MAX_WINDOW, sizeof(csp_packet_t *));
-	if (conn->rdp.tx_queue == NULL) {
-		csp_log_error("Failed to create TX queue for conn\r\n");
-		csp_bin_sem_remove(&conn->rdp.tx_wait);
-		return CSP_ERR_NOMEM;
-	}
+	return CSP_ERR_NONE;
+
+}
 
-	/* Create RX queue */
-	conn->rdp.rx_queue = csp_queue_create(CSP_RDP_MAX_WINDOW * 2, sizeof(csp_packet_t *));
-	if (conn->rdp.rx_queue == NULL) {
-		csp_log_error("Failed to create RX queue for conn\r\n");
-		csp_bin_sem_remove(&conn->rdp.tx_wait);
-		csp_queue_remove(conn->rdp.tx_queue);
+/**
+ * CLOSED CONNECTION QUARANTINE
+ * A closing connection normally waits in CLOSE-WAIT until the peer replies to the RST, or
+ * conn_timeout expires. With --with-rdp-quarantine, the connection identifier and sequence
+ * numbers are instead held in a small table, and the connection is released immediately.
+ * The router looks up the table for segments that match no connection, after running the
+ * security check with the options of the closed connection.
+ * Late segments for the closed connection are answered with a RST, and do not open a new
+ * connection. A SYN with a new sequence number starts a new connection on the same ports.
+ */
+int csp_rdp_quarantine_init(void) {
+
+#if CSP_RDP_QUARANTINE > 0
+	if (csp_mutex_create(&csp_rdp_quarantine_lock) != CSP_MUTEX_OK) {
+		csp_log_error("Failed to create RDP quarantine lock\r\n");
 		return CSP_ERR_NOMEM;
 	}
+#endif
 
 	return CSP_ERR_NONE;
 
 }
 
+#if CSP_RDP_QUARANTINE > 0
+/* Find the entry for an incoming identifier, expired entries are released on the way */
+static rdp_quarantine_t * csp_rdp_quarantine_find(uint32_t id, uint32_t time_now) {
+
+	rdp_quarantine_t * entry = NULL;
+	int i;
+
+	for (i = 0; i < CSP_RDP_QUARANTINE; i++) {
+		if (!csp_rdp_quarantine[i].used)
+			continue;
+		if (csp_rdp_time_after(time_now, csp_rdp_quarantine[i].expires)) {
+			csp_rdp_quarantine[i].used = 0;
+			continue;
+		}
+		if (csp_rdp_quarantine[i].id == (id & CSP_ID_CONN_MASK))
+			entry = &csp_rdp_quarantine[i];
+	}
+
+	return entry;
+
+}
+
+static int csp_rdp_quarantine_add(csp_conn_t * conn) {
+
+	uint32_t time_now = csp_get_ms();
+	int i;
+
+	csp_mutex_lock(&csp_rdp_quarantine_lock, CSP_MAX_DELAY);
+
+	/* A previous connection on the same ports is replaced */
+	rdp_quarantine_t * entry = csp_rdp_quarantine_find(conn->idin.ext, time_now);
+	for (i = 0; entry == NULL && i < CSP_RDP_QUARANTINE; i++)
+		if (!csp_rdp_quarantine[i].used)
+			entry = &csp_rdp_quarantine[i];
+
+	if (entry != NULL) {
+		entry->id = conn->idin.ext & CSP_ID_CONN_MASK;
+		entry->idout = conn->idout;
+		entry->opts = conn->opts;
+		entry->expires = time_now + conn->rdp.conn_timeout;
+		entry->snd_nxt = conn->rdp.snd_nxt;
+		entry->rcv_cur = conn->rdp.rcv_cur;
+		entry->rcv_irs = conn->rdp.rcv_irs;
+		entry->used = 1;
+	}
+
+	csp_mutex_unlock(&csp_rdp_quarantine_lock);
+
+	return entry != NULL ? CSP_ERR_NONE : CSP_ERR_NOMEM;
+
+}
+#endif
+
+int csp_rdp_quarantined(uint32_t id, uint32_t * opts) {
+
+#if CSP_RDP_QUARANTINE > 0
+	csp_mutex_lock(&csp_rdp_quarantine_lock, CSP_MAX_DELAY);
+	rdp_quarantine_t * entry = csp_rdp_quarantine_find(id, csp_get_ms());
+	if (entry != NULL && opts != NULL)
+		*opts = entry->opts;
+	csp_mutex_unlock(&csp_rdp_quarantine_lock);
+	return entry != NULL;
+#else
+	return 0;
+#endif
+
+}
+
+int csp_rdp_quarantine_check(csp_packet_t * packet) {
+
+#if CSP_RDP_QUARANTINE > 0
+	if (packet->length < sizeof(rdp_header_t))
+		return 0;
+
+	/* The header stays in network byte order, the packet may still go to a new connection */
+	rdp_header_t * header = csp_rdp_header_ref(packet);
+	csp_packet_t * reply = NULL;
+	csp_id_t idout;
+	int held = 1;
+
+	csp_mutex_lock(&csp_rdp_quarantine_lock, CSP_MAX_DELAY);
+
+	rdp_quarantine_t * entry = csp_rdp_quarantine_find(packet->id.ext, csp_get_ms());
+	if (entry == NULL) {
+		held = 0;
+	} else if (header->rst) {
+		/* The peer has closed as well, as in CLOSE-WAIT */
+		csp_log_protocol("RDP: RST for closed connection, leaving quarantine\r\n");
+		entry->used = 0;
+	} else if (header->syn && !header->ack && csp_ntoh16(header->seq_nr) != entry->rcv_irs) {
+		csp_log_protocol("RDP: New SYN for closed connection, leaving quarantine\r\n");
+		entry->used = 0;
+		held = 0;
+	} else if (header->ack && !header->syn && (reply = csp_buffer_get_small(20)) != NULL) {
+		/* Answer with a reset, as in CLOSE-WAIT */
+		reply->length = 0;
+		rdp_header_t * rst = csp_rdp_header_add(reply);
+		rst->seq_nr = csp_hton16(entry->snd_nxt);
+		rst->ack_nr = csp_hton16(entry->rcv_cur);
+		rst->ack = 1;
+		rst->rst = 1;
+		idout = entry->idout;
+		idout.pri = idout.pri < CSP_PRIO_HIGH ? idout.pri : CSP_PRIO_HIGH;
+	}
+
+	csp_mutex_unlock(&csp_rdp_quarantine_lock);
+
+	if (reply != NULL) {
+		csp_log_protocol("RDP: Segment for closed connection, sending RST\r\n");
+		if (csp_send_direct(idout, reply, 0) != CSP_ERR_NONE)
+			csp_buffer_free(reply);
+	}
+
+	return held;
+#else
+	return 0;
+#endif
+
+}
+
 /**
  * @note This function may only be called from csp_close, and is therefore
  * without any checks for null pointers.
@@ -1035,13 +2007,22 @@ int csp_rdp_close(csp_conn_t * conn) {
 	if (conn->rdp.state != RDP_CLOSE_WAIT) {
 		conn->rdp.state = RDP_CLOSE_WAIT;
 		conn->timestamp = csp_get_ms();
+		csp_conn_schedule(conn, conn->timestamp + conn->rdp.conn_timeout);
 		csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_RST, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 		csp_log_protocol("RDP Close, sent RST on conn %p\r\n", conn);
+#if CSP_RDP_QUARANTINE > 0
+		/* Release the connection now, unless the quarantine is full */
+		if (csp_rdp_quarantine_add(conn) == CSP_ERR_NONE) {
+			conn->rdp.state = RDP_CLOSED;
+			return CSP_ERR_NONE;
+		}
+#endif
 		return CSP_ERR_AGAIN;
 	}
 
 	csp_log_protocol("RDP Close in CLOSE_WAIT, now closing\r\n");
 	conn->rdp.state = RDP_CLOSED;
+	conn->rdp.peer_reset = 0;
 	return CSP_ERR_NONE;
 
 }
@@ -1081,14 +2062,42 @@ void csp_rdp_get_opt(unsigned int * window_size, unsigned int * conn_timeout_ms,
 		*ack_delay_count = csp_rdp_ack_delay_count;
 }
 
+void csp_rdp_set_rto(unsigned int rto_min_ms, unsigned int rto_max_ms) {
+	csp_rdp_rto_min = rto_min_ms;
+	csp_rdp_rto_max = rto_max_ms > rto_min_ms ? rto_max_ms : rto_min_ms;
+}
+
+void csp_rdp_get_rto(unsigned int * rto_min_ms, unsigned int * rto_max_ms) {
+
+	if (rto_min_ms)
+		*rto_min_ms = csp_rdp_rto_min;
+	if (rto_max_ms)
+		*rto_max_ms = csp_rdp_rto_max;
+}
+
+void csp_rdp_set_fast_retransmit(unsigned int threshold) {
+	csp_rdp_fast_retransmit = threshold;
+}
+
+void csp_rdp_set_cc(unsigned int flags) {
+	csp_rdp_cc = flags;
+}
+
 #ifdef CSP_DEBUG
 void csp_rdp_conn_print(csp_conn_t * conn) {
 
 	if (conn == NULL)
 		return;
 
-	printf("\tRDP: State %"PRIu16", rcv %"PRIu16", snd %"PRIu16", win %"PRIu32"\r\n",
-			conn->rdp.state, conn->rdp.rcv_cur, conn->rdp.snd_una, conn->rdp.window_size);
+	printf("\tRDP: State %"PRIu16", rcv %"PRIu16", snd %"PRIu16", win %"PRIu32", srtt %"PRIu32", rto %"PRIu32"\r\n",
+			conn->rdp.state, conn->rdp.rcv_cur, conn->rdp.snd_una, conn->rdp.window_size,
+			conn->rdp.srtt >> 3, conn->rdp.rto);
+	printf("\tRDP: Retransmits fast %"PRIu32", timeout %"PRIu32"\r\n",
+			conn->rdp.fast_retransmits, conn->rdp.timeout_retransmits);
+	if (conn->rdp.cc)
+		printf("\tRDP: cwnd %"PRIu32", ssthresh %"PRIu32", pacing %"PRIu32" seg/s\r\n",
+				csp_rdp_send_window(conn), conn->rdp.ssthresh,
+				(conn->rdp.cc & CSP_RDP_CC_PACING) && conn->rdp.srtt >= 8 ? csp_rdp_send_window(conn) * 8000 / conn->rdp.srtt : 0);
 
 }
 #endif
@@ -35,9 +35,15 @@ int csp_rdp_allocate(csp_conn_t * conn);
 int csp_rdp_close(csp_conn_t * conn);
 void csp_rdp_conn_print(csp_conn_t * conn);
 int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout);
+int csp_rdp_send_fastopen(csp_conn_t * conn, csp_packet_t * packet);
+void csp_rdp_send_deferred_syn(csp_conn_t * conn);
+size_t csp_rdp_segment_overhead(csp_conn_t * conn);
 int csp_rdp_check_ack(csp_conn_t * conn);
 void csp_rdp_check_timeouts(csp_conn_t * conn);
 void csp_rdp_flush_all(csp_conn_t * conn);
+int csp_rdp_quarantine_init(void);
+int csp_rdp_quarantined(uint32_t id, uint32_t * opts);
+int csp_rdp_quarantine_check(csp_packet_t * packet);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -39,6 +39,7 @@ void csp_udp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			csp_close(conn);
 			return;
 		}
+		csp_conn_notify(conn->listener);
 
 		/* Ensure that this connection will not be posted to this socket again */
 		conn->socket = NULL;